@@ -31,6 +31,43 @@ void sub_task2(int ex)
     terminate_task();
 }
 
+static void rr_task(const char *name)
+{
+    /*
+     * Round robin tasks sharing a resource. The turn shall not be given to the other task
+     * while the resource is held, or get_resource of the other task would fail.
+     */
+    volatile int spin;
+    int conflict = 0;
+    int i;
+
+    for (i = 0; i < 100; i++) {
+        if (get_resource(RESOURCE1) != E_OK) {
+            conflict++;
+            continue;
+        }
+        for (spin = 0; spin < 10000; spin++)
+            continue;
+        release_resource(RESOURCE1);
+    }
+
+    if (conflict)
+        printf("[%s]: resource conflict %d\n", name, conflict);
+    else
+        printf("[%s]: done\n", name);
+    terminate_task();
+}
+
+void rr_task1(int ex)
+{
+    rr_task("rr_task1");
+}
+
+void rr_task2(int ex)
+{
+    rr_task("rr_task2");
+}
+
 void main_task_callback(void)
 {
     extern status_type_t sys_activate_task(task_type_t task_id);
@@ -39,7 +76,7 @@ void main_task_callback(void)
 
 void main_task(int ex)
 {
-    volatile int i = 0;
+    tick_t anchor;
     char buf[64];
 
     gets(buf);
@@ -51,20 +88,19 @@ void main_task(int ex)
     activate_task(SUB_TASK2);
 
     /* Set alarm */
-    set_rel_alarm(ALARM3, 0, 200);
+    set_rel_alarm(ALARM3, 1, 200);
 
     get_resource(RESOURCE1);
     puts("[main_task]: set_event");
     release_resource(RESOURCE1);
     set_event(SUB_TASK1, EVENT1);
 
+    get_systick(&anchor);
     while (1) {
-        if (i++ == 0x80000) {
-            get_resource(RESOURCE1);
-            puts("[main_task]");
-            release_resource(RESOURCE1);
-            i = 0;
-        }
+        wait_next_period(&anchor, 1000);
+        get_resource(RESOURCE1);
+        puts("[main_task]");
+        release_resource(RESOURCE1);
     }
 }
 
@@ -84,7 +120,10 @@ int main()
 #elif  STM32F407xx
     devno = 1;
 #endif
-    info.pri = 1;
+    info.baud_rate = 115200;
+    info.pri = KERNEL_INTERRUPT_PRI;
+    info.send_cbr = NULL;
+    info.recv_cbr = NULL;
     uart_hal_init(devno);
     uart_hal_open(devno, &info);
     send1(devno, 'b');
@@ -1,14 +1,16 @@
 #include "lm3s6965evb.h"
 #include "system.h"
+#include "uros.h"
 #include "uart_hal.h"
 
 static uart_t *uart[] = {UART0, UART1, UART2};
 static uint32_t irq[] = {5, 6, 33};
-static void (*uart_send_cbr)(void) = NULL;
-static void (*uart_recv_cbr)(void) = NULL;
 
 #define NR_UART (sizeof(uart)/sizeof(uart[0]))
 
+static void (*uart_send_cbr[NR_UART])(uint32_t devno);
+static void (*uart_recv_cbr[NR_UART])(uint32_t devno);
+
 int uart_hal_init(uint32_t devno)
 {
     if (devno >= NR_UART)
@@ -28,10 +30,19 @@ int uart_hal_open(uint32_t devno, const uart_hal_oinfo_t *info)
     /* UART0->IBRD = XXX; */
     /* UART0->FBRD = YYY; */
 
+    /*
+     * Enable the 16 bytes FIFOs with 8 bits words. The send interrupt is raised when the send FIFO
+     * gets 1/8 full, and the receive interrupt when the receive FIFO gets 1/2 full or it times out.
+     */
+    uart[devno]->CTL &= ~0x1;
+    uart[devno]->LCRH = 0x70;
+    uart[devno]->IFLS = (0x2 << 3) | 0x0;
+    uart[devno]->CTL |= 0x301;
+
     nvic_set_irq_pri(irq[devno], info->pri);
 
-    uart_send_cbr = info->send_cbr;
-    uart_recv_cbr = info->recv_cbr;
+    uart_send_cbr[devno] = info->send_cbr;
+    uart_recv_cbr[devno] = info->recv_cbr;
 
     return 0;
 }
@@ -57,7 +68,7 @@ int uart_hal_enable_cbr(uint32_t devno, uart_hal_cbr_flag_t flag)
         uart[devno]->IM |= 0x1 << 5;
 
     if (flag == UART_HAL_CBR_FLAG_RECV)
-        uart[devno]->IM |= 0x1 << 4;
+        uart[devno]->IM |= (0x1 << 4) | (0x1 << 6); /* receive and receive timeout */
 
     /* Enable external IRQ */
     nvic_enable_irq(irq[devno]);
@@ -70,7 +81,7 @@ size_t uart_hal_send(uint32_t devno, char c)
     if (devno >= NR_UART)
         return 0;
 
-    if ((uart[devno]->FR & 0x8) != 0) /* when data is being transmitted */
+    if ((uart[devno]->FR & 0x20) != 0) /* when send FIFO is full */
         return 0;
 
     uart[devno]->DR = c;
@@ -91,17 +102,41 @@ size_t uart_hal_recv(uint32_t devno, char *c)
     return 1;
 }
 
-void Uart0_Handler()
+static void uart_isr(uint32_t devno)
 {
-    if (uart[0]->MIS & (0x1 << 5)) {
-        uart[0]->ICR = 0x1 << 5;
-        if (uart_send_cbr)
-            uart_send_cbr();
+    uint32_t mis;
+
+    enter_isr();
+
+    mis = uart[devno]->MIS;
+
+    if (mis & (0x1 << 5)) {
+        uart[devno]->ICR = 0x1 << 5;
+        if (uart_send_cbr[devno])
+            uart_send_cbr[devno](devno);
     }
 
-    if (uart[0]->MIS & (0x1 << 4)) {
-        uart[0]->ICR = 0x1 << 4;
-        if (uart_recv_cbr)
-            uart_recv_cbr();
+    /* The receive timeout flushes the bytes fewer than the FIFO level. */
+    if (mis & ((0x1 << 4) | (0x1 << 6))) {
+        uart[devno]->ICR = (0x1 << 4) | (0x1 << 6);
+        if (uart_recv_cbr[devno])
+            uart_recv_cbr[devno](devno);
     }
+
+    exit_isr();
+}
+
+void Uart0_Handler()
+{
+    uart_isr(0);
+}
+
+void Uart1_Handler()
+{
+    uart_isr(1);
+}
+
+void Uart2_Handler()
+{
+    uart_isr(2);
 }
@@ -13,6 +13,8 @@ void DebugMon_Handler() __attribute__((weak));
 void PendSV_Handler() __attribute__((weak));
 void SysTick_Handler() __attribute__((weak));
 void Uart0_Handler() __attribute__((weak));
+void Uart1_Handler() __attribute__((weak));
+void Uart2_Handler() __attribute__((weak));
   
 void (* const vector_table[])()  = {
     (void (*)())&stack_bottom,
@@ -37,4 +39,32 @@ void (* const vector_table[])()  = {
     NULL,
     NULL,
     Uart0_Handler,
+    Uart1_Handler,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    Uart2_Handler,
 };
@@ -53,7 +53,10 @@ static void EnablePll()
 void system_init(void)
 {
     SystemInit();
-    
+
+    /* FPU context is stacked lazily on exception entry (this is the reset value) */
+    FPU->FPCCR |= FPU_FPCCR_ASPEN_Msk | FPU_FPCCR_LSPEN_Msk;
+
     EnablePll();
 
     /* Enable clock for each peripherals */
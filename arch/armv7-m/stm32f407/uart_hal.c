@@ -1,17 +1,38 @@
 #include "stm32f4xx.h"
 #include "system.h"
+#include "uros.h"
 #include "uart_hal.h"
 
 static USART_TypeDef *const uart[] = {USART1, USART2, USART3, UART4, UART5};
-static const IRQn_Type irq[] = {USART1_IRQn, USART2_IRQn, USART3_IRQn, UART4_IRQn, UART4_IRQn};
+static const IRQn_Type irq[] = {USART1_IRQn, USART2_IRQn, USART3_IRQn, UART4_IRQn, UART5_IRQn};
 
 #define NR_UART (sizeof(uart)/sizeof(uart[0]))
 
+/* Clock and pins of each device */
+typedef struct {
+    volatile uint32_t *clk_en;
+    uint32_t     clk_bit;
+    uint32_t     pclk;    /* Frequency of the peripheral bus */
+    GPIO_TypeDef *tx_port;
+    uint32_t     tx_pin;
+    GPIO_TypeDef *rx_port;
+    uint32_t     rx_pin;
+    uint32_t     af;      /* Alternate function of the pins */
+} uart_port_t;
+
+static const uart_port_t port[] = {
+    {&RCC->APB2ENR, RCC_APB2ENR_USART1EN, 84000000, GPIOA,  9, GPIOA, 10, 7},
+    {&RCC->APB1ENR, RCC_APB1ENR_USART2EN, 42000000, GPIOD,  5, GPIOD,  6, 7},
+    {&RCC->APB1ENR, RCC_APB1ENR_USART3EN, 42000000, GPIOD,  8, GPIOD,  9, 7},
+    {&RCC->APB1ENR, RCC_APB1ENR_UART4EN,  42000000, GPIOC, 10, GPIOC, 11, 8},
+    {&RCC->APB1ENR, RCC_APB1ENR_UART5EN,  42000000, GPIOC, 12, GPIOD,  2, 8},
+};
+
 typedef struct {
     bool_t send_cbr_en;
     bool_t recv_cbr_en;
-    void (*send_cbr)(void);
-    void (*recv_cbr)(void);
+    void (*send_cbr)(uint32_t devno);
+    void (*recv_cbr)(uint32_t devno);
 } uart_hal_t;
 
 uart_hal_t uart_hal[NR_UART];
@@ -33,21 +54,35 @@ int uart_hal_init(uint32_t devno)
     return 0;
 }
 
+static void gpio_set_af(GPIO_TypeDef *gpio, uint32_t pin, uint32_t af)
+{
+    /* Enable the clock of the GPIO port and assign the alternate function to the pin */
+    RCC->AHB1ENR |= 0x1 << (((uint32_t)gpio - GPIOA_BASE) / (GPIOB_BASE - GPIOA_BASE));
+
+    gpio->MODER = (gpio->MODER & ~(0x3 << (pin*2))) | (0x2 << (pin*2));
+    gpio->AFR[pin >> 3] = (gpio->AFR[pin >> 3] & ~(0xF << ((pin & 0x7)*4))) | (af << ((pin & 0x7)*4));
+}
+
 int uart_hal_open(uint32_t devno, const uart_hal_oinfo_t *info)
 {
+    const uart_port_t *pp;
+
     if (devno >= NR_UART)
         return 1;
 
-    GPIOD->MODER |= GPIO_MODER_MODER5_1 | GPIO_MODER_MODER6_1;
-    GPIOD->AFR[0] = (0x7 << (5*4)) | (0x7 << (6*4));
+    pp = &port[devno];
+
+    *pp->clk_en |= pp->clk_bit;
+    gpio_set_af(pp->tx_port, pp->tx_pin, pp->af);
+    gpio_set_af(pp->rx_port, pp->rx_pin, pp->af);
 
     uart[devno]->CR1 |=
         USART_CR1_UE |    /* USART enable */
         USART_CR1_TE |    /* Transmitter enable */
         USART_CR1_RE;     /* Receiver enable */
 
-    /* A real hardware requires baud rate settings. */
-    uart[devno]->BRR = 0x16D; /* PCLK = 84MHz, Baud rate = 115200 bps, OVER8 = 0, hence BRR = 22.8125 */
+    /* OVER8 = 0, hence BRR = PCLK / baud rate in 12.4 fixed point, e.g. 22.8125 for 115200 bps on APB1 */
+    uart[devno]->BRR = (pp->pclk + info->baud_rate / 2) / info->baud_rate;
 
     nvic_set_irq_pri(irq[devno], info->pri);
 
@@ -124,16 +159,45 @@ size_t uart_hal_recv(uint32_t devno, char *c)
     return 1;
 }
 
-void USART2_IRQHandler()
+static void uart_isr(uint32_t devno)
 {
-    if (uart[1]->SR & USART_SR_TXE) {
-        uart[1]->CR1 &= ~USART_CR1_TXEIE;
-        if (uart_hal[1].send_cbr_en)
-            uart_hal[1].send_cbr();
+    enter_isr();
+
+    if (uart[devno]->SR & USART_SR_TXE) {
+        uart[devno]->CR1 &= ~USART_CR1_TXEIE;
+        if (uart_hal[devno].send_cbr_en)
+            uart_hal[devno].send_cbr(devno);
     }
 
-    if (uart[1]->SR & USART_SR_RXNE) {
-        if (uart_hal[1].recv_cbr_en)
-            uart_hal[1].recv_cbr();
+    if (uart[devno]->SR & USART_SR_RXNE) {
+        if (uart_hal[devno].recv_cbr_en)
+            uart_hal[devno].recv_cbr(devno);
     }
+
+    exit_isr();
+}
+
+void USART1_IRQHandler()
+{
+    uart_isr(0);
+}
+
+void USART2_IRQHandler()
+{
+    uart_isr(1);
+}
+
+void USART3_IRQHandler()
+{
+    uart_isr(2);
+}
+
+void UART4_IRQHandler()
+{
+    uart_isr(3);
+}
+
+void UART5_IRQHandler()
+{
+    uart_isr(4);
 }
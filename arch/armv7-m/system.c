@@ -2,24 +2,47 @@
 #include "lib.h"
 #include "uros.h"
 #include "uart_hal.h"
+#include "config.h"
+
+#if KERNEL_INTERRUPT_PRI < 1 || KERNEL_INTERRUPT_PRI > NVIC_PRI_LOWEST
+#error "KERNEL_INTERRUPT_PRI shall be 1 to (1 << NVIC_PRIO_BITS) - 1, since BASEPRI of 0 masks nothing."
+#endif
 
 extern void reset_handler(void);
 extern void system_init(void);
 
-__attribute__((naked))
+/* Nesting level of critical sections and the interrupt mask before the outermost one */
+static uint32_t cs_nest;
+static uint32_t cs_basepri;
+
 void disable_interrupt(void)
 {
-    asm volatile("mov r0, #1;"
-                 "msr PRIMASK, r0;"
-                 "bx lr;");
+    uint32_t basepri;
+
+    /*
+     * Only interrupts whose priority is lower than or equal to KERNEL_INTERRUPT_PRI are masked.
+     * BASEPRI_MAX never lowers the mask set by the outer critical section.
+     */
+    asm volatile("mrs %0, BASEPRI;"
+                 "msr BASEPRI_MAX, %1;"
+                 "isb;"
+                 : "=&r" (basepri)
+                 : "r" (NVIC_PRI(KERNEL_INTERRUPT_PRI))
+                 : "memory");
+
+    if (cs_nest++ == 0)
+        cs_basepri = basepri;
 }
 
-__attribute__((naked))
 void enable_interrupt(void)
 {
-    asm volatile("mov r0, #0;"
-                 "msr PRIMASK, r0;"
-                 "bx lr;");
+    /* The mask is restored when the outermost critical section ends. */
+    if (--cs_nest == 0)
+        asm volatile("msr BASEPRI, %0;"
+                     "isb;"
+                     :
+                     : "r" (cs_basepri)
+                     : "memory");
 }
 
 __attribute__((naked))
@@ -36,11 +59,78 @@ void set_psp(uint32_t *val)
                  "bx lr;");
 }
 
+__attribute__((naked))
+uint32_t count_leading_zeros(uint32_t val)
+{
+    asm volatile("clz r0, r0;"
+                 "bx lr;");
+}
+
+uint32_t atomic_or(volatile uint32_t *addr, uint32_t val)
+{
+    uint32_t ret;
+    uint32_t fail;
+
+    /* Retry if the exclusive access was lost by an interruption. Return the updated value. */
+    do {
+        asm volatile("ldrex %0, [%2];"
+                     "orr   %0, %0, %3;"
+                     "strex %1, %0, [%2];"
+                     : "=&r" (ret), "=&r" (fail)
+                     : "r" (addr), "r" (val)
+                     : "memory");
+    } while (fail);
+
+    return ret;
+}
+
+uint32_t atomic_and(volatile uint32_t *addr, uint32_t val)
+{
+    uint32_t ret;
+    uint32_t fail;
+
+    do {
+        asm volatile("ldrex %0, [%2];"
+                     "and   %0, %0, %3;"
+                     "strex %1, %0, [%2];"
+                     : "=&r" (ret), "=&r" (fail)
+                     : "r" (addr), "r" (val)
+                     : "memory");
+    } while (fail);
+
+    return ret;
+}
+
+__attribute__((naked))
+void wait_for_interrupt(void)
+{
+    /*
+     * Interrupts masked by BASEPRI cannot wake up the processor, so they are masked by
+     * PRIMASK instead while sleeping. They are taken when the critical section ends.
+     */
+    asm volatile("mrs   r0, BASEPRI;"
+                 "cpsid i;"
+                 "mov   r1, #0;"
+                 "msr   BASEPRI, r1;"
+                 "dsb;"
+                 "wfi;"
+                 "msr   BASEPRI, r0;"
+                 "cpsie i;"
+                 "isb;"
+                 "bx lr;");
+}
+
 void pend_sv(void)
 {
     ICSR |= (1<<28);
 }
 
+void clear_pend_sv(void)
+{
+    /* Read-modify-write would set PENDSVSET again, since it reads as one while pending. */
+    ICSR = (1<<27);
+}
+
 void nvic_enable_irq(uint32_t irq)
 {
     NVIC_ISER[irq >> 5] = 0x1 << (irq & 0x1F);
@@ -48,7 +138,7 @@ void nvic_enable_irq(uint32_t irq)
 
 void nvic_set_irq_pri(uint32_t irq, uint32_t pri)
 {
-    NVIC_IPR[irq] = pri;
+    NVIC_IPR[irq] = NVIC_PRI(pri);
 }
 
 void memory_init()
@@ -68,24 +158,28 @@ void memory_init()
 
 void Reset_Handler(void)
 {
-    /* Disable all interrupts until initialization is completed. */
-    disable_interrupt();
-
     /* System dependent initialization */
     system_init();
 
     memory_init();
 
-    /* Priority level less than or equal to 0 is allowed when interrupt is enabled. */
-    set_basepri(0);
+    /*
+     * Disable interrupts which call kernel services until initialization is completed.
+     * This is done after memory_init(), which clears the nesting level of critical sections.
+     */
+    disable_interrupt();
 
     /* Set priority group to 0 */
     AIRCR = 0x05FA0000;
 
-    /* Set system exception priority */
+    /*
+     * Set system exception priority.
+     * SVCall runs at the kernel interrupt priority not to delay the interrupts above it,
+     * and SysTick and PendSV run at the lowest priority.
+     */
     SHPR1 = 0x00000000;
-    SHPR2 = 0x00000000;
-    SHPR3 = 0x02020000;
+    SHPR2 = NVIC_PRI(KERNEL_INTERRUPT_PRI) << 24;
+    SHPR3 = (NVIC_PRI(NVIC_PRI_LOWEST) << 24) | (NVIC_PRI(NVIC_PRI_LOWEST) << 16);
 
     /* Enable double word stack alignment */
     NVIC_CCR |= 0x200;
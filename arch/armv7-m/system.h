@@ -4,11 +4,13 @@
 #ifdef LM3S6965EVB
 #include "lm3s6965evb.h"
 #define BUILD_TARGET_ARCH "LM3S6965EVB"
+#define NVIC_PRIO_BITS 3
 #endif
 
 #ifdef STM32F407xx
 #include "stm32f4xx.h"
 #define BUILD_TARGET_ARCH "STM32F407"
+#define NVIC_PRIO_BITS __NVIC_PRIO_BITS
 #endif
 
 #include "stdtype.h"
@@ -19,7 +21,7 @@
 #define AIRCR      (*(volatile uint32_t *)0xE000ED0C)
 #define NVIC_CCR   (*(volatile uint32_t *)0xE000ED14)
 #define NVIC_ISER  ( (volatile uint32_t *)0xE000E100)
-#define NVIC_IPR   ( (volatile uint32_t *)0xE000E400)
+#define NVIC_IPR   ( (volatile uint8_t  *)0xE000E400) /* One byte for each IRQ */
 
 #define SHPR1      (*(volatile uint32_t *)0xE000ED18)
 #define SHPR2      (*(volatile uint32_t *)0xE000ED1C)
@@ -27,14 +29,29 @@
 
 #define SYST_CSR   (*(volatile uint32_t *)0xE000E010)
 #define SYST_RVR   (*(volatile uint32_t *)0xE000E014)
+#define SYST_CVR   (*(volatile uint32_t *)0xE000E018)
 #define SYST_CALIB (*(volatile uint32_t *)0xE000E01C)
-#define SYST_CSR_TICKINT 0x2
+#define SYST_CSR_ENABLE    0x1
+#define SYST_CSR_TICKINT   0x2
+#define SYST_CSR_COUNTFLAG 0x10000
+#define SYST_RVR_MAX       0xFFFFFF
+
+#define ICSR_PENDSTSET (1<<26)
+
+/* Priority levels are 0 to (1 << NVIC_PRIO_BITS) - 1, which are held in the upper bits of the register. */
+#define NVIC_PRI(pri)  (((pri) << (8 - NVIC_PRIO_BITS)) & 0xFF)
+#define NVIC_PRI_LOWEST ((1 << NVIC_PRIO_BITS) - 1)
 
 void disable_interrupt(void);
 void enable_interrupt(void);
 void set_basepri(int val);
 void set_psp(uint32_t *val);
+uint32_t count_leading_zeros(uint32_t val);
+uint32_t atomic_or(volatile uint32_t *addr, uint32_t val);
+uint32_t atomic_and(volatile uint32_t *addr, uint32_t val);
+void wait_for_interrupt(void);
 void pend_sv(void);
+void clear_pend_sv(void);
 void nvic_enable_irq(uint32_t irq);
 void nvic_set_irq_pri(uint32_t irq, uint32_t pri);
 
@@ -6,8 +6,8 @@
 typedef struct {
     uint32_t baud_rate;
     uint32_t pri;
-    void (*send_cbr)();
-    void (*recv_cbr)();
+    void (*send_cbr)(uint32_t devno); /* Called when the send FIFO has room */
+    void (*recv_cbr)(uint32_t devno); /* Called when the receive FIFO has data */
 } uart_hal_oinfo_t;
 
 typedef enum {
@@ -0,0 +1,171 @@
+#include "coroutine.h"
+
+static void co_enqueue(co_sched_t *sp, coroutine_t *co)
+{
+    co->next = NULL;
+    if (sp->ready)
+        sp->ready_tail->next = co;
+    else
+        sp->ready = co;
+    sp->ready_tail = co;
+}
+
+static coroutine_t *co_dequeue(co_sched_t *sp)
+{
+    coroutine_t *co = sp->ready;
+
+    if (co)
+        sp->ready = co->next;
+    return co;
+}
+
+static void co_wait(co_sched_t *sp, coroutine_t *co)
+{
+    co->next = NULL;
+    if (sp->waiting)
+        sp->waiting_tail->next = co;
+    else
+        sp->waiting = co;
+    sp->waiting_tail = co;
+}
+
+static bool_t co_expired(tick_t wakeup, tick_t now)
+{
+    /* The system tick wraps around, so the times are compared by the difference. */
+    return now - wakeup < TICK_MAX / 2;
+}
+
+static void co_sleep(co_sched_t *sp, coroutine_t *co, tick_t now)
+{
+    coroutine_t **cop;
+
+    /* Coroutines sleeping until the same time are woken up in FIFO order. */
+    co->wakeup = now + co->ticks;
+    for (cop = &sp->sleeping; *cop; cop = &(*cop)->next) {
+        if (!co_expired((*cop)->wakeup, co->wakeup))
+            break;
+    }
+    co->next = *cop;
+    *cop = co;
+}
+
+static void co_wake_up(co_sched_t *sp, event_mask_type_t event, tick_t now)
+{
+    coroutine_t **cop;
+    coroutine_t *co;
+
+    /* All coroutines waiting for any of the events are resumed. */
+    cop = &sp->waiting;
+    sp->waiting_tail = NULL;
+    while ((co = *cop) != NULL) {
+        if (co->ev_wait & event) {
+            *cop = co->next;
+            co->ev_got  = co->ev_wait & event;
+            co->ev_wait = 0;
+            co_enqueue(sp, co);
+        }
+        else {
+            sp->waiting_tail = co;
+            cop = &co->next;
+        }
+    }
+
+    while ((co = sp->sleeping) != NULL && co_expired(co->wakeup, now)) {
+        sp->sleeping = co->next;
+        co_enqueue(sp, co);
+    }
+}
+
+void co_init(co_sched_t *sp)
+{
+    sp->ready        = NULL;
+    sp->ready_tail   = NULL;
+    sp->waiting      = NULL;
+    sp->waiting_tail = NULL;
+    sp->sleeping     = NULL;
+}
+
+void co_spawn(co_sched_t *sp, coroutine_t *co, co_func_t func, void *arg)
+{
+    co->func    = func;
+    co->arg     = arg;
+    co->line    = 0;
+    co->ev_wait = 0;
+    co->ev_got  = 0;
+    co_enqueue(sp, co);
+}
+
+void co_run(co_sched_t *sp)
+{
+    /*
+     * Run the coroutines until all of them are done.
+     * The events awaited by the coroutines are the events of the calling task, and
+     * the task waits for them by wait_event_timeout() until the nearest wakeup of
+     * the sleeping coroutines when no coroutine is ready.
+     */
+    coroutine_t *co;
+    coroutine_t *last;
+    event_mask_type_t mask;
+    event_mask_type_t event;
+    task_type_t self;
+    tick_t now;
+    tick_t ticks;
+
+    get_task_id(&self);
+
+    while (sp->ready || sp->waiting || sp->sleeping) {
+        get_systick(&now);
+
+        /* Run the coroutines ready at this point once. The ones yielding go to the next round. */
+        last = sp->ready ? sp->ready_tail : NULL;
+        while (last && (co = co_dequeue(sp)) != NULL) {
+            switch (co->func(co)) {
+            case CO_STATE_READY:
+                co_enqueue(sp, co);
+                break;
+            case CO_STATE_WAITING:
+                co_wait(sp, co);
+                break;
+            case CO_STATE_SLEEPING:
+                co_sleep(sp, co, now);
+                break;
+            default:
+                break;
+            }
+            if (co == last)
+                break;
+        }
+
+        mask = 0;
+        for (co = sp->waiting; co; co = co->next)
+            mask |= co->ev_wait;
+
+        /* Wait until the nearest wakeup, or only check the events if any coroutine is ready. */
+        ticks = 0;
+        if (!sp->ready && sp->sleeping) {
+            get_systick(&now);
+            if (!co_expired(sp->sleeping->wakeup, now))
+                ticks = sp->sleeping->wakeup - now;
+        }
+
+        if (mask) {
+            if (sp->ready || sp->sleeping)
+                wait_event_timeout(mask, ticks);
+            else
+                wait_event(mask);
+        }
+        else if (ticks)
+            sleep_ticks(ticks);
+
+        event = 0;
+        if (mask) {
+            get_event(self, &event);
+            event &= mask;
+            if (event)
+                clear_event(event);
+        }
+
+        get_systick(&now);
+        co_wake_up(sp, event, now);
+    }
+}
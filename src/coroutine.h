@@ -0,0 +1,71 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "stdtype.h"
+#include "uros.h"
+
+/*
+ * Stackless coroutines multiplexed in a single task.
+ * A coroutine is a function which is resumed from the point where it returned last time,
+ * so local variables are not preserved across CO_YIELD, CO_AWAIT_EVENT and CO_AWAIT_TICKS.
+ * Variables which live across them shall be kept in the structure pointed by arg.
+ */
+
+typedef enum {
+    CO_STATE_READY,
+    CO_STATE_WAITING,
+    CO_STATE_SLEEPING,
+    CO_STATE_DONE,
+} co_state_t;
+
+struct coroutine;
+typedef co_state_t (*co_func_t)(struct coroutine *co);
+
+typedef struct coroutine {
+    struct coroutine  *next;
+    co_func_t         func;
+    void              *arg;
+    uint32_t          line;    /* Point to resume, or 0 to start from the beginning */
+    event_mask_type_t ev_wait; /* Events awaited by CO_AWAIT_EVENT */
+    event_mask_type_t ev_got;  /* Events which resumed the coroutine */
+    tick_t            ticks;   /* Ticks awaited by CO_AWAIT_TICKS */
+    tick_t            wakeup;  /* System tick when the sleep ends */
+} coroutine_t;
+
+typedef struct {
+    coroutine_t *ready;        /* Ready coroutines in FIFO order */
+    coroutine_t *ready_tail;
+    coroutine_t *waiting;      /* Coroutines waiting for events in FIFO order */
+    coroutine_t *waiting_tail;
+    coroutine_t *sleeping;     /* Sleeping coroutines in the order of wakeup */
+} co_sched_t;
+
+#define CO_BEGIN(co)    switch ((co)->line) { case 0:
+#define CO_END(co)      } (co)->line = 0; return CO_STATE_DONE
+
+#define CO_RESUME_POINT(co, state)                              \
+    do {                                                        \
+        (co)->line = __LINE__;                                  \
+        return (state);                                         \
+    case __LINE__:;                                             \
+    } while (0)
+
+#define CO_YIELD(co) CO_RESUME_POINT(co, CO_STATE_READY)
+
+#define CO_AWAIT_EVENT(co, event)                               \
+    do {                                                        \
+        (co)->ev_wait = (event);                                \
+        CO_RESUME_POINT(co, CO_STATE_WAITING);                  \
+    } while (0)
+
+#define CO_AWAIT_TICKS(co, n)                                   \
+    do {                                                        \
+        (co)->ticks = (n);                                      \
+        CO_RESUME_POINT(co, CO_STATE_SLEEPING);                 \
+    } while (0)
+
+void co_init(co_sched_t *sp);
+void co_spawn(co_sched_t *sp, coroutine_t *co, co_func_t func, void *arg);
+void co_run(co_sched_t *sp);
+
+#endif
@@ -5,13 +5,46 @@
 #include "lib.h"
 #include "config.h"
 
-#define NR_COUNTER 1
+#define NR_PRI       (PRI_MAX + 1)
+#define PRI_MAP_SIZE ((NR_PRI + 31) / 32)
+
+/*
+ * Words of the context saved by software (r4-r11, and EXC_RETURN if the FPU context is saved)
+ * and by hardware on exception entry (r0-r3, r12, lr, pc, xPSR).
+ */
+/*
+ * The FPU context is handled whenever the build enables the FPU, since the compiler may emit
+ * VFP instructions in any task and the processor then stacks an extended frame.
+ */
+#if defined(__FPU_USED) && (__FPU_USED == 1)
+#define FPU_CONTEXT
+#define SW_CONTEXT_SIZE 9
+#else
+#define SW_CONTEXT_SIZE 8
+#endif
+#define HW_CONTEXT_SIZE 8
+#define EXC_RETURN_THREAD_PSP 0xFFFFFFFD
+
+#define TIMER_WHEEL_BITS   4
+#define TIMER_WHEEL_SIZE   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK   (TIMER_WHEEL_SIZE - 1)
+#define TIMER_WHEEL_LEVELS 4
+
+#define WAIT_FOREVER TICK_MAX
+
+/* Timer Type */
+typedef struct tmr {
+    wque_t   link;                      /* Link of a slot of the timer wheel */
+    tick_t   expire;                    /* Time of the timer wheel when the timer expires */
+    void     (*handler)(struct tmr *);
+} tmr_t;
 
 /* Resource Type */
-typedef struct {
-    uint32_t owner;
-    int      pre_pri;
-    wque_t   wque;
+typedef struct res {
+    struct task *owner;
+    int          pre_pri; /* Priority of the owner before the resource was allocated */
+    struct res   *next;   /* Resource allocated before this one by the owner */
+    wque_t       wque;    /* Tasks waiting for the mutex in priority order */
 } res_t;
 
 /* Task Control Block (TCB) */
@@ -20,20 +53,42 @@ typedef struct task {
     int          pri;
     uint32_t     ev_wait;
     uint32_t     ev_flag;
-    wque_t       wque;
-    context_t    context;
+    bool_t       ev_all;  /* Wait for all events of ev_wait */
+    uint32_t     act_count; /* Activations recorded while the task is not suspended */
+    tmr_t        timer;   /* Timeout of waiting or sleeping (time of the wheel is systick) */
+    wque_t       wque;    /* Link of the ready queue or a resource wait queue */
+    res_t        *res_top; /* Resource allocated last (top of the resource stack) */
+    res_t        *wait_res; /* Mutex which the task is waiting for */
+    tick_t       slice;   /* Remaining ticks of the current time slice */
+    context_t    context; /* Saved context, or 0 if the task has not started */
+    struct task  *basic_prev; /* Basic task started before this one on the shared stack */
 } task_t;
 
+/*
+ * Timer Wheel Type
+ * Timers are hashed into the slots of level n by bits [4n+3:4n] of the expiration time,
+ * where n is the smallest level that can hold the remaining time.
+ * When a level goes round, the next slot of the upper level is cascaded into the lower levels.
+ */
+typedef struct {
+    tick_t   now;
+    uint32_t used[TIMER_WHEEL_LEVELS]; /* Bit (31 - i) is set if slot[level][i] may not be empty */
+    wque_t   slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+} timer_wheel_t;
+
 /* Counter Type */
 typedef struct {
-    tick_t       value;
-    tick_t       next_tick;
-    tick_t       last_tick;
+    counter_type_t type; /* Hardware counters are driven by SysTick, software ones by increment_counter */
+    tick_t        value;
+    tick_t        next_tick;
+    tick_t        last_tick;
+    timer_wheel_t wheel; /* Active alarms (time of the wheel is the number of increments) */
     const alarm_base_t *alarm_basep;
 } counter_t;
 
 /* Alarm Type */
 typedef struct {
+    tmr_t       timer;
     alarm_state_t state;
     alarm_type_t  type;
     tick_t        next_count;
@@ -43,6 +98,13 @@ typedef struct {
     counter_t     *counterp;
 } alarm_t;
 
+/* Ready Queue Type */
+typedef struct {
+    uint32_t grp;               /* Bit (31 - i) is set if map[i] is not zero */
+    uint32_t map[PRI_MAP_SIZE]; /* Bit (31 - pri % 32) is set if que[pri] is not empty */
+    wque_t   que[NR_PRI];       /* Ready tasks of each priority (head is que.next) */
+} ready_que_t;
+
 extern void main(void);
 
 #define CHECK_ID(id, limit) if (id >= limit) return E_OS_ID
@@ -75,9 +137,18 @@ SYS_CALL_STUB(13, get_alarm, uint32_t alarm_id, tick_t *tick);
 SYS_CALL_STUB(14, set_rel_alarm, uint32_t alarm_id, tick_t increment, tick_t cycle);
 SYS_CALL_STUB(15, set_abs_alarm, uint32_t alarm_id, tick_t start, tick_t cycle);
 SYS_CALL_STUB(16, cancel_alarm, uint32_t alarm_id);
+SYS_CALL_STUB(17, increment_counter, uint32_t counter_id);
+SYS_CALL_STUB(18, wait_event_all, event_mask_type_t event);
+SYS_CALL_STUB(19, wait_event_timeout, event_mask_type_t event, tick_t ticks);
+SYS_CALL_STUB(20, sleep_ticks, tick_t ticks);
+SYS_CALL_STUB(21, wait_next_period, tick_t *anchor, tick_t period);
+SYS_CALL_STUB(22, get_systick, tick_t *tick);
+SYS_CALL_STUB(23, schedule_task, void);
 
 static void schedule();
-static void wake_up(res_t *rp);
+static bool_t ready_rotate(task_t *tp);
+static void raise_dispatch_pri(task_t *tp);
+static void release(task_t *tp, res_t *rp);
 
 const sys_call_t syscall_table[] = {
     (sys_call_t)sys_debug,
@@ -97,6 +168,13 @@ const sys_call_t syscall_table[] = {
     (sys_call_t)sys_set_rel_alarm,
     (sys_call_t)sys_set_abs_alarm,
     (sys_call_t)sys_cancel_alarm,
+    (sys_call_t)sys_increment_counter,
+    (sys_call_t)sys_wait_event_all,
+    (sys_call_t)sys_wait_event_timeout,
+    (sys_call_t)sys_sleep_ticks,
+    (sys_call_t)sys_wait_next_period,
+    (sys_call_t)sys_get_systick,
+    (sys_call_t)sys_schedule_task,
 };
 
 uint32_t user_task_stack[USER_TASK_STACK_SIZE];
@@ -104,36 +182,109 @@ task_t task[NR_TASK];
 res_t res[NR_RES];
 counter_t counter[NR_COUNTER];
 alarm_t alarm[NR_ALARM];
-const alarm_base_t alarm_base[NR_COUNTER] = {
-    {TICK_MAX, 10, 1,}, /* maxallowedvalue, ticksperbase, mincycle */
-};
+ready_que_t ready_que;
+timer_wheel_t task_wheel;
 
 task_t *taskp      = NULL;
 task_t *taskp_next = NULL;
+task_t *basic_last = NULL; /* Basic task started last on the shared stack */
 tick_t systick;
+uint32_t systick_rvr;
+uint32_t isr_nest;       /* Nesting level of interrupt handlers calling kernel services */
+bool_t   resched_req;    /* Scheduling is requested by interrupt handlers */
+uint32_t dispatch_count; /* Number of context switches requested to PendSV */
+uint32_t dispatch_elided;/* Number of scheduling which did not change the running task */
+
+static void start_task(task_t *tp)
+{
+    /*
+     * Build the initial stack frame of the task.
+     * Basic tasks share a stack, on which they are started and terminated in LIFO order,
+     * so the frame is built below the context of the basic task started last.
+     */
+    const task_rom_t *task_romp = task_rom + (tp - task);
+    uint32_t *sp = task_romp->stack_bottom;
+
+    if (task_romp->basic) {
+        if (basic_last)
+            sp = (uint32_t *)basic_last->context;
+        tp->basic_prev = basic_last;
+        basic_last     = tp;
+    }
+
+    sp -= SW_CONTEXT_SIZE + HW_CONTEXT_SIZE;
+    /* Initialize stack frame necessary for starting in user mode */
+#ifdef DEBUG
+    memset(sp, 0xBBCCDDEE, sizeof(uint32_t) * (SW_CONTEXT_SIZE + HW_CONTEXT_SIZE));
+#endif
+#ifdef FPU_CONTEXT
+    sp[8] = EXC_RETURN_THREAD_PSP; /* Start with the basic frame without the FPU context */
+#endif
+    sp[SW_CONTEXT_SIZE + 7] = 0x01000000; /* xPSR */
+    sp[SW_CONTEXT_SIZE + 6] = (uint32_t)task_romp->entry;
+    tp->context = (context_t)sp;
+}
+
+context_t dispatch(context_t sp)
+{
+    /*
+     * Called by PendSV_Handler with the context of the running task saved at sp.
+     * A task has no context until it is dispatched first after the activation, and
+     * the context of a terminated task is discarded.
+     */
+    if (taskp->context)
+        taskp->context = sp;
+
+    taskp = taskp_next;
+    if (!taskp->context)
+        start_task(taskp);
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    raise_dispatch_pri(taskp);
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    return taskp->context;
+}
 
 __attribute__((naked))
 void PendSV_Handler()
 {
     /*
      * Save context informations.
-     * r4-r11 are saved in the user stack and PSP is saved in the TCB.
+     * r4-r11 are saved in the user stack and PSP is saved in the TCB by dispatch().
      */
+#ifdef FPU_CONTEXT
+    /*
+     * EXC_RETURN is saved with r4-r11 to return with the same type of stack frame.
+     * Its bit 4 is cleared if the task has used the FPU and the processor has reserved
+     * the extended frame, so that s16-s31 are saved only for such a task.
+     * s0-s15 and FPSCR in the extended frame are stacked lazily by the processor (FPCCR.LSPEN).
+     */
+    asm("mrs   r0, PSP;"
+        "tst   lr, #0x10;"
+        "it    eq;"
+        "vstmdbeq r0!, {s16-s31};"
+        "stmdb r0!, {r4-r11, lr};"
+        "bl    dispatch;"
+        "ldmia r0!, {r4-r11, lr};"
+        "tst   lr, #0x10;"
+        "it    eq;"
+        "vldmiaeq r0!, {s16-s31};"
+        "msr   PSP, r0;"
+        "bx    lr;");
+#else
     asm("mrs   r0, PSP;"
         "stmdb r0!, {r4-r11};"
-        "str   r0, [%0];"
-        : 
-        : "r" (&taskp->context)
-        : "r0");
-
-    taskp = taskp_next;
-
-    asm("ldmia %0!, {r4-r11};"
-        "msr   PSP, %0;"
-        "orr   lr, #0xD;"             /* Return back to user mode (0xFFFFFFFD) */
-        "bx    lr;"
-        :
-        : "r" (taskp->context));
+        "bl    dispatch;"
+        "ldmia r0!, {r4-r11};"
+        "msr   PSP, r0;"
+        "mvn   lr, #2;"               /* Return back to user mode (0xFFFFFFFD) */
+        "bx    lr;");
+#endif
 }
 
 static tick_t elapsed_time(tick_t now, tick_t last, tick_t max_value)
@@ -143,58 +294,328 @@ static tick_t elapsed_time(tick_t now, tick_t last, tick_t max_value)
     if (last <= now)
         elapse = now - last;
     else
-        elapse = now + (max_value - last); /* wrap arounded */
+        elapse = now + (max_value - last) + 1; /* wrap arounded */
 
     return elapse;
 }
 
-void SysTick_Handler()
+static tick_t count_add(tick_t value, tick_t inc, tick_t max_value)
 {
-    alarm_t *alarmp;
-    const alarm_action_rom_t *action_romp;
-    counter_t *counterp;
-    bool_t single_alarm;
+    tick_t rest = max_value - value;
 
-    for (alarmp = alarm; alarmp < alarm + NR_ALARM; alarmp++) {
-        if (alarmp->state == ALARM_STATE_ACTIVE) {
-            /* In case of single alarms, cycle shall be zero. */
-            single_alarm = !alarmp->cycle;
-            if (single_alarm && alarmp->expired)
-                continue;
+    if (max_value != TICK_MAX)
+        inc %= max_value + 1;
+
+    if (inc <= rest)
+        return value + inc;
+    else
+        return inc - rest - 1; /* wrap arounded */
+}
+
+static void timer_link(wque_t *head, tmr_t *tp)
+{
+    wque_t *wp = &tp->link;
+
+    wp->next         = head;
+    wp->prev         = head->prev;
+    head->prev->next = wp;
+    head->prev       = wp;
+}
+
+static void timer_unlink(tmr_t *tp)
+{
+    wque_t *wp = &tp->link;
+
+    wp->prev->next = wp->next;
+    wp->next->prev = wp->prev;
+    wp->next = NULL;
+    wp->prev = NULL;
+}
+
+static void timer_move(wque_t *from, wque_t *to)
+{
+    /* Move all timers of the list 'from' into the empty list 'to'. */
+    if (from->next == from) {
+        to->next = to;
+        to->prev = to;
+    }
+    else {
+        to->next       = from->next;
+        to->prev       = from->prev;
+        to->next->prev = to;
+        to->prev->next = to;
+        from->next     = from;
+        from->prev     = from;
+    }
+}
+
+static void timer_add(timer_wheel_t *wp, tmr_t *tp)
+{
+    /* The expiration time shall be later than the current time of the wheel. */
+    tick_t remain = tp->expire - wp->now;
+    int level;
+    int i;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+        if (remain < ((tick_t)1 << ((level + 1) * TIMER_WHEEL_BITS)))
+            break;
+    }
+    i = (tp->expire >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+
+    timer_link(&wp->slot[level][i], tp);
+    wp->used[level] |= 0x80000000 >> i;
+}
+
+static void timer_wheel_init(timer_wheel_t *wp)
+{
+    int level;
+    int i;
+
+    wp->now = 0;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        wp->used[level] = 0;
+        for (i = 0; i < TIMER_WHEEL_SIZE; i++) {
+            wp->slot[level][i].next = &wp->slot[level][i];
+            wp->slot[level][i].prev = &wp->slot[level][i];
+        }
+    }
+}
+
+static bool_t timer_active(tmr_t *tp)
+{
+    return tp->link.next != NULL;
+}
+
+static void timer_remove(tmr_t *tp)
+{
+    /* The used bit of the slot is left as it is and cleared when the slot is examined. */
+    if (timer_active(tp))
+        timer_unlink(tp);
+}
+
+static void timer_cascade(timer_wheel_t *wp, int level)
+{
+    wque_t list;
+    tmr_t *tp;
+    int i = (wp->now >> (level * TIMER_WHEEL_BITS)) & TIMER_WHEEL_MASK;
+
+    timer_move(&wp->slot[level][i], &list);
+    wp->used[level] &= ~(0x80000000 >> i);
+
+    while (list.next != &list) {
+        tp = (tmr_t *)list.next;
+        timer_unlink(tp);
+        timer_add(wp, tp);
+    }
+}
+
+static void timer_tick(timer_wheel_t *wp)
+{
+    /*
+     * Advance the time of the wheel and call the handlers of the expired timers.
+     * Only the timers in a single slot of level 0 are examined, and they are all expired.
+     */
+    wque_t expired;
+    tmr_t *tp;
+    int level;
+    int i;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    wp->now++;
+
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (wp->now & (((tick_t)1 << (level * TIMER_WHEEL_BITS)) - 1))
+            break;
+        timer_cascade(wp, level);
+    }
+
+    i = wp->now & TIMER_WHEEL_MASK;
+    timer_move(&wp->slot[0][i], &expired);
+    wp->used[0] &= ~(0x80000000 >> i);
+
+    while (expired.next != &expired) {
+        tp = (tmr_t *)expired.next;
+        timer_unlink(tp);
+
+        enable_interrupt();
+        /* CRITICAL SECTION: END */
+
+        tp->handler(tp);
+
+        /* CRITICAL SECTION: BEGIN */
+        disable_interrupt();
+    }
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+}
 
-            if (alarmp->counterp->value == alarmp->next_count) {
-                alarmp->next_count += alarmp->cycle; /* This result can be overflow. */
-                alarmp->last_count = alarmp->counterp->value;
-                alarmp->expired = TRUE;
-
-                action_romp = alarm_action_rom + (alarmp - alarm);
-
-                switch (action_romp->action_type) {
-                case ACTION_TYPE_ACTIVATETASK:
-                    sys_activate_task(action_romp->action.task_id);
-                    break;
-                case ACTION_TYPE_SETEVENT:
-                    sys_set_event(action_romp->action.setevent.task_id, action_romp->action.setevent.event);
-                    break;
-                case ACTION_TYPE_ALARMCALLBACK:
-                    action_romp->action.callback();
-                    break;
-                }
+static tick_t timer_next(timer_wheel_t *wp)
+{
+    /*
+     * Return the time until the wheel has to be advanced with a work,
+     * i.e. the nearest expiration in level 0 or the nearest cascade of upper levels.
+     * TICK_MAX is returned if no timer is active.
+     */
+    tick_t next = TICK_MAX;
+    tick_t time;
+    tick_t period;
+    uint32_t start;
+    uint32_t used;
+    uint32_t i;
+    int level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        period = wp->now >> (level * TIMER_WHEEL_BITS);
+        start  = (period + 1) & TIMER_WHEEL_MASK;
+        while (wp->used[level]) {
+            /* Search the slots in the order of [start, TIMER_WHEEL_SIZE) and [0, start) */
+            used = wp->used[level];
+            used = (used << start) | (used >> (TIMER_WHEEL_SIZE - start));
+            used &= ~(((uint32_t)1 << (32 - TIMER_WHEEL_SIZE)) - 1);
+            i = (start + count_leading_zeros(used)) & TIMER_WHEEL_MASK;
+
+            if (wp->slot[level][i].next == &wp->slot[level][i]) {
+                /* All timers in the slot have been removed. */
+                wp->used[level] &= ~(0x80000000 >> i);
+                continue;
             }
+
+            time = ((period + 1 + count_leading_zeros(used)) << (level * TIMER_WHEEL_BITS)) - wp->now;
+            if (time < next)
+                next = time;
+            break;
         }
     }
 
+    return next;
+}
+
+static void alarm_expire(tmr_t *tp)
+{
+    alarm_t *alarmp = (alarm_t *)tp;
+    counter_t *counterp = alarmp->counterp;
+    const alarm_action_rom_t *action_romp = &alarm_rom[alarmp - alarm].action;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    /* The alarm may be canceled after it is taken out of the wheel. */
+    if (alarmp->state != ALARM_STATE_ACTIVE) {
+        enable_interrupt();
+        return;
+    }
+
+    alarmp->last_count = counterp->value;
+    alarmp->expired = TRUE;
+
+    /* In case of single alarms, cycle shall be zero. */
+    if (alarmp->cycle) {
+        alarmp->next_count = count_add(counterp->value, alarmp->cycle, counterp->alarm_basep->maxallowedvalue);
+        tp->expire += alarmp->cycle;
+        timer_add(&counterp->wheel, tp);
+    }
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    switch (action_romp->action_type) {
+    case ACTION_TYPE_ACTIVATETASK:
+        sys_activate_task(action_romp->action.task_id);
+        break;
+    case ACTION_TYPE_SETEVENT:
+        sys_set_event(action_romp->action.setevent.task_id, action_romp->action.setevent.event);
+        break;
+    case ACTION_TYPE_ALARMCALLBACK:
+        action_romp->action.callback();
+        break;
+    }
+}
+
+static void counter_increment(counter_t *counterp)
+{
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    if (counterp->value++ == counterp->alarm_basep->maxallowedvalue)
+        counterp->value = 0;
+    counterp->last_tick = systick;
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    /* Alarms expire only when the counter is incremented. */
+    timer_tick(&counterp->wheel);
+}
+
+void enter_isr(void)
+{
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    isr_nest++;
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+}
+
+void exit_isr(void)
+{
+    bool_t resched = FALSE;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    if (--isr_nest == 0 && resched_req) {
+        resched_req = FALSE;
+        resched = TRUE;
+    }
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    /* The scheduling requests in interrupt handlers are coalesced into one. */
+    if (resched)
+        schedule();
+}
+
+void SysTick_Handler()
+{
+    counter_t *counterp;
+    bool_t rotated;
+
+    enter_isr();
+
     for (counterp = counter; counterp < counter + NR_COUNTER; counterp++) {
-        if (systick == counterp->next_tick) {
-            if (counterp->value++ == counterp->alarm_basep->maxallowedvalue)
-                counterp->value = 0;
+        if (counterp->type == COUNTER_TYPE_HARDWARE && systick == counterp->next_tick) {
             counterp->next_tick += counterp->alarm_basep->ticksperbase;
-            counterp->last_tick = systick;
+            counter_increment(counterp);
         }
     }
 
     /* Systick is free running. */
     systick++;
+
+    /* Timeouts of the tasks */
+    timer_tick(&task_wheel);
+
+    /* Round robin among the tasks of the same priority */
+    if ((taskp->state & TASK_STATE_RUNNING) && taskp->slice && --taskp->slice == 0) {
+        /* CRITICAL SECTION: BEGIN */
+        disable_interrupt();
+
+        rotated = ready_rotate(taskp);
+
+        enable_interrupt();
+        /* CRITICAL SECTION: END */
+
+        if (rotated)
+            schedule();
+    }
+
+    exit_isr();
 }
 
 __attribute__((naked))
@@ -219,39 +640,186 @@ void SVC_Handler()
         : "r0", "r1");
 }
 
+static task_t *wque_to_task(wque_t *wp)
+{
+    /*
+     * Task that owns the queue link can be calculated
+     * by the offset from the beggining of a task array.
+     */
+    return &task[((size_t)wp - (size_t)task) / sizeof(task_t)];
+}
+
+static void ready_insert(task_t *tp, wque_t *prev)
+{
+    wque_t *wp = &tp->wque;
+    int pri = tp->pri;
+
+    wp->next         = prev->next;
+    wp->prev         = prev;
+    prev->next->prev = wp;
+    prev->next       = wp;
+
+    ready_que.map[pri >> 5] |= 0x80000000 >> (pri & 0x1F);
+    ready_que.grp           |= 0x80000000 >> (pri >> 5);
+}
+
+static void ready_enqueue(task_t *tp)
+{
+    /* Newly ready task is placed at the tail of its priority with a full time slice. */
+    tp->slice = task_rom[tp - task].time_slice;
+    ready_insert(tp, ready_que.que[tp->pri].prev);
+}
+
+static void ready_push(task_t *tp)
+{
+    /* Running task is placed at the head of its priority not to lose its turn. */
+    ready_insert(tp, &ready_que.que[tp->pri]);
+}
+
+static void ready_remove(task_t *tp)
+{
+    wque_t *wp = &tp->wque;
+    int pri = tp->pri;
+
+    wp->prev->next = wp->next;
+    wp->next->prev = wp->prev;
+    wp->next = NULL;
+    wp->prev = NULL;
+
+    if (ready_que.que[pri].next == &ready_que.que[pri]) {
+        ready_que.map[pri >> 5] &= ~(0x80000000 >> (pri & 0x1F));
+        if (!ready_que.map[pri >> 5])
+            ready_que.grp &= ~(0x80000000 >> (pri >> 5));
+    }
+}
+
+static void change_pri(task_t *tp, int pri)
+{
+    /* Priority of a ready task must be changed together with its position in the ready queue. */
+    if (tp->state & (TASK_STATE_READY | TASK_STATE_RUNNING)) {
+        ready_remove(tp);
+        tp->pri = pri;
+        ready_push(tp);
+    }
+    else
+        tp->pri = pri;
+}
+
+static void raise_dispatch_pri(task_t *tp)
+{
+    /*
+     * Tasks whose priority is not higher than the dispatch priority cannot preempt the
+     * running task (preemption threshold). The raised priority is kept while it is preempted.
+     */
+    int pri = task_rom[tp - task].dispatch_pri;
+
+    if (pri < tp->pri)
+        change_pri(tp, pri);
+}
+
+static void lower_dispatch_pri(task_t *tp)
+{
+    /* The dispatch priority is given up when the task stops running, unless it holds resources. */
+    if (!tp->res_top)
+        change_pri(tp, task_rom[tp - task].pri);
+}
+
+static bool_t ready_rotate(task_t *tp)
+{
+    /*
+     * Move the task to the tail of its priority to give the turn to the next one.
+     * Return TRUE if another task of the same priority is waiting for the turn.
+     */
+    if (tp->res_top || tp->pri != task_rom[tp - task].pri) {
+        /*
+         * The turn is kept while the task holds resources or runs above its own priority,
+         * since the tasks of the same priority may use the resources or be excluded by
+         * the dispatch priority. The turn is given at the first tick after that.
+         */
+        tp->slice = 1;
+        return FALSE;
+    }
+
+    if (tp->wque.next == tp->wque.prev) {
+        tp->slice = task_rom[tp - task].time_slice;
+        return FALSE;
+    }
+
+    ready_remove(tp);
+    ready_enqueue(tp);
+
+    return TRUE;
+}
+
+static task_t *ready_highest(void)
+{
+    uint32_t grp;
+    int pri;
+
+    if (!ready_que.grp)
+        return NULL;
+
+    grp = count_leading_zeros(ready_que.grp);
+    pri = (grp << 5) + count_leading_zeros(ready_que.map[grp]);
+
+    return wque_to_task(ready_que.que[pri].next);
+}
+
 void schedule()
 {
     /*
      * This routine selects the next running task from ready state tasks.
      * Scheduling algorithm is priority based round robin.
-     * If SysTick timer is invoked while it is running, this routine may be reentered.
-     * This situation has no problem for now, because current implementation has no ready queue
-     * and the operation on the data structure like a linked list do not exist.
+     * Tasks of the same priority are served in FIFO order and a task whose time slice
+     * has run out is moved to the tail of its priority by SysTick_Handler.
+     * The highest priority is found in constant time by the bitmap of the ready queue.
+     * If SysTick timer is invoked while it is running, this routine may be reentered,
+     * so the ready queue is examined in the critical section.
+     * In interrupt handlers, the scheduling is only requested and done once by exit_isr().
+     * PendSV is not requested if the running task continues to run.
      */
 
-    task_t *p = taskp;
-    task_t *n = NULL;
-    int pri = PRI_MAX + 1;
+    task_t *n;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
 
-    if (taskp->state & TASK_STATE_RUNNING)
-        taskp->state = TASK_STATE_READY;
+    if (isr_nest) {
+        resched_req = TRUE;
+        enable_interrupt();
+        return;
+    }
 
-    do {
-        if ((p->state & TASK_STATE_READY) && p->pri < pri) {
-            pri = p->pri;
-            n = p;
-        }
-        if (++p == task + NR_TASK)
-            p = task;
-    } while (p != taskp);
+    if (taskp_next->state & TASK_STATE_RUNNING)
+        taskp_next->state = TASK_STATE_READY;
 
-    if (n == NULL)
+    n = ready_highest();
+    if (n == NULL) {
+        enable_interrupt();
         return; /* ERROR: no task is available */
+    }
 
-    taskp_next = n;
-    taskp_next->state = TASK_STATE_RUNNING;
+    n->state = TASK_STATE_RUNNING;
 
-    pend_sv();
+    if (n == taskp && taskp->context) {
+        /*
+         * No context switch is needed. Withdraw a switch requested before if any.
+         * A task which has terminated and been activated again is dispatched to start over.
+         */
+        if (taskp_next != taskp)
+            clear_pend_sv();
+        taskp_next = n;
+        raise_dispatch_pri(n);
+        dispatch_elided++;
+    }
+    else {
+        taskp_next = n;
+        dispatch_count++;
+        pend_sv();
+    }
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
 }
 
 status_type_t sys_debug(const char *s)
@@ -263,7 +831,6 @@ status_type_t sys_debug(const char *s)
 status_type_t init_task(task_t *tp, task_state_t state)
 {
     status_type_t status = E_OK;
-    uint32_t *sp;
     const task_rom_t *task_romp = task_rom + (tp - task);
 
     if (tp->state & (TASK_STATE_RUNNING | TASK_STATE_READY | TASK_STATE_WAITING))
@@ -271,19 +838,43 @@ status_type_t init_task(task_t *tp, task_state_t state)
     else {
         tp->state = state;
         tp->pri   = task_romp->pri;
+        tp->res_top = NULL;
+        tp->wait_res = NULL;
 
-        sp = task_romp->stack_bottom - 16;
-        /* Initialize stack frame necessary for starting in user mode */
-#ifdef DEBUG
-        memset(sp, 0xBBCCDDEE, sizeof(uint32_t) * 16);
-#endif
-        sp[15] = 0x01000000;          /* xPSR */
-        sp[14] = (uint32_t)task_romp->entry;
-        tp->context = (context_t)sp;
+        /* Stack frame is built when the task is dispatched. */
+        tp->context = 0;
+
+        /* A partial line left by the previous activation is not prefixed to the new output. */
+        stdout_discard(tp - task);
+
+        if (state & TASK_STATE_READY)
+            ready_enqueue(tp);
     }
     return status;
 }
 
+static bool_t activatable(task_t *tp)
+{
+    return (tp->state & TASK_STATE_SUSPENDED) ||
+        tp->act_count + 1 < task_rom[tp - task].max_activations;
+}
+
+static status_type_t activate(task_t *tp)
+{
+    /*
+     * Activation of a task which is not suspended is recorded,
+     * and the task runs again when it terminates.
+     */
+    if (!activatable(tp))
+        return E_OS_LIMIT;
+
+    if (tp->state & TASK_STATE_SUSPENDED)
+        return init_task(tp, TASK_STATE_READY);
+
+    tp->act_count++;
+    return E_OK;
+}
+
 status_type_t sys_activate_task(task_type_t task_id)
 {
     status_type_t status = E_OK;
@@ -296,7 +887,7 @@ status_type_t sys_activate_task(task_type_t task_id)
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
-    status = init_task(tp, TASK_STATE_READY);
+    status = activate(tp);
 
     enable_interrupt();
     /* CRITICAL SECTION: END */
@@ -311,27 +902,33 @@ status_type_t sys_activate_task(task_type_t task_id)
 
 void terminate(task_t *tp)
 {
-    int i;
     res_t *rp;
-    task_type_t task_id = taskp - task;
 
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    ready_remove(taskp);
     taskp->state = TASK_STATE_SUSPENDED;
 
+    /* Discard the context, and free the shared stack if it is a basic task */
+    taskp->context = 0;
+    if (task_rom[taskp - task].basic)
+        basic_last = taskp->basic_prev;
+
     /* Clear event */
     taskp->ev_wait = 0;
     taskp->ev_flag = 0;
 
-    /* Release all allocating resources */
-    /* CRITICAL SECTION: BEGIN */
-    disable_interrupt();
+    /* Release all allocating resources in the reverse order and restore the priority */
+    while ((rp = taskp->res_top) != NULL) {
+        taskp->pri = rp->pre_pri;
+        release(taskp, rp);
+    }
 
-    rp = res;
-    for (i = 0; i < NR_RES; i++, rp++) {
-        if (rp->owner == task_id) {
-            rp->owner = 0;
-            /* Wake up another task if it is waiting for this resoure */
-            wake_up(rp);
-        }
+    /* Recorded activation is started at the tail of its priority, after the tasks activated before it. */
+    if (taskp->act_count) {
+        taskp->act_count--;
+        init_task(taskp, TASK_STATE_READY);
     }
 
     enable_interrupt();
@@ -359,11 +956,12 @@ status_type_t sys_chain_task(task_type_t task_id)
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
-    if (tp->state != TASK_STATE_SUSPENDED)
+    /* The calling task can be always activated again after it terminates. */
+    if (tp != taskp && !activatable(tp))
         status = E_OS_LIMIT;
     else {
         terminate(taskp);
-        init_task(tp, TASK_STATE_READY);
+        activate(tp);
     }
 
     enable_interrupt();
@@ -383,122 +981,204 @@ status_type_t sys_get_task_id(task_type_t *task_id)
 
 status_type_t sys_get_task_state(task_type_t task_id, task_state_t *task_state)
 {
-    CHECK_ID(task_id, NR_TASK);
+    CHECK_ID(task_id, NR_TASK);
+
+    *task_state = task[task_id].state;
+
+    return E_OK;
+}
+
+static void wait_insert(res_t *rp, task_t *tp)
+{
+    wque_t *wp = &tp->wque;
+    wque_t *prev;
+
+    /* Waiting tasks are ordered by priority, and tasks of the same priority in FIFO order. */
+    for (prev = rp->wque.prev; prev != &rp->wque; prev = prev->prev) {
+        if (wque_to_task(prev)->pri <= tp->pri)
+            break;
+    }
+
+    wp->next         = prev->next;
+    wp->prev         = prev;
+    prev->next->prev = wp;
+    prev->next       = wp;
+}
+
+static void wait_remove(task_t *tp)
+{
+    wque_t *wp = &tp->wque;
+
+    wp->prev->next = wp->next;
+    wp->next->prev = wp->prev;
+    wp->next = NULL;
+    wp->prev = NULL;
+}
+
+static bool_t task_waiting_for(res_t *rp)
+{
+    return rp->wque.next != &rp->wque;
+}
+
+static void inherit_pri(task_t *tp, int pri)
+{
+    res_t *rp;
+
+    /*
+     * Raise priority of the owner to that of the waiting task. If the owner is also waiting
+     * for a mutex, the priority is passed on to the owner of the mutex, and so on.
+     */
+    while (pri < tp->pri) {
+        change_pri(tp, pri);
+        rp = tp->wait_res;
+        if (!rp)
+            break;
+        wait_remove(tp);
+        wait_insert(rp, tp);
+        tp = rp->owner;
+    }
+}
+
+static void acquire(task_t *tp, res_t *rp)
+{
+    /* Allocate the resource and push it on the resource stack of the task */
+    rp->owner   = tp;
+    rp->pre_pri = tp->pri;
+    rp->next    = tp->res_top;
+    tp->res_top = rp;
+}
+
+static bool_t ceiling_held(task_t *tp)
+{
+    /* Return TRUE if the task occupies a resource of the priority ceiling protocol */
+    res_t *rp;
+
+    for (rp = tp->res_top; rp; rp = rp->next) {
+        if (res_rom[rp - res].type == RES_TYPE_CEILING)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void release(task_t *tp, res_t *rp)
+{
+    task_t *wtp;
 
-    *task_state = task[task_id].state;
+    /* Release the resource and pop it from the resource stack of the task */
+    rp->owner   = NULL;
+    tp->res_top = rp->next;
 
-    return E_OK;
+    /* Hand over the mutex to the highest priority task waiting for it */
+    if (task_waiting_for(rp)) {
+        wtp = wque_to_task(rp->wque.next);
+        wait_remove(wtp);
+        wtp->wait_res = NULL;
+        acquire(wtp, rp);
+        if (task_waiting_for(rp))
+            inherit_pri(wtp, wque_to_task(rp->wque.next)->pri);
+        wtp->state = TASK_STATE_READY;
+        ready_enqueue(wtp);
+    }
 }
 
 status_type_t sys_get_resource(uint32_t res_id)
 {
-    status_type_t status;
+    status_type_t status = E_OK;
     res_t *rp;
-    wque_t *wp;
+    const res_rom_t *res_romp;
+    bool_t blocked = FALSE;
 
     CHECK_ID(res_id, NR_RES);
 
     rp = &res[res_id];
+    res_romp = &res_rom[res_id];
+
+    if (rp->owner == taskp)
+        return E_OS_ACCESS;
+
+    /*
+     * Basic tasks cannot wait for mutexes. They cannot hold them either, since a basic task
+     * inheriting a priority could resume while a task started after it is on the shared stack.
+     */
+    if (res_romp->type == RES_TYPE_MUTEX && task_rom[taskp - task].basic)
+        return E_OS_ACCESS;
+
+    /*
+     * Under the priority ceiling protocol, no other task can run while the resource is
+     * occupied, so the resource is never found occupied by another task.
+     * The ceiling must not be lower than the static priority of the task.
+     */
+    if (res_romp->type == RES_TYPE_CEILING &&
+        (rp->owner || res_romp->pri > task_rom[taskp - task].pri))
+        return E_OS_ACCESS;
 
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
     if (!rp->owner) {
-        /* Resource is free. Allocate it for this task. */
-        status = E_OK;
-        rp->owner = taskp - task;
+        acquire(taskp, rp);
+
+        /* Raise priority to the ceiling of the resource */
+        if (res_romp->type == RES_TYPE_CEILING && res_romp->pri < taskp->pri)
+            change_pri(taskp, res_romp->pri);
+    }
+    else if (ceiling_held(taskp)) {
+        /* Waiting at a ceiling priority would let the other users of the ceiling resource run. */
+        status = E_OS_RESOURCE;
     }
     else {
-        /* Resource is already allocated. Add this task into the wait queue. */
-        status = E_OS_ACCESS;
-
-        /* Add this task into the wait queue */
-        wp                    = &taskp->wque;
-        wp->next              = rp->wque.next;
-        wp->prev              = &rp->wque;
-        rp->wque.next->prev   = wp;
-        rp->wque.next         = wp;
-
-        /* Go to wait state */
-        taskp->state = TASK_STATE_WAITING;
+        /*
+         * Mutex is occupied. Wait until the owner hands it over,
+         * lending the priority of this task to the owner (priority inheritance).
+         */
+        ready_remove(taskp);
+        taskp->state    = TASK_STATE_WAITING;
+        taskp->wait_res = rp;
+        lower_dispatch_pri(taskp);
+        wait_insert(rp, taskp);
+        inherit_pri(rp->owner, taskp->pri);
+        blocked = TRUE;
     }
 
     enable_interrupt();
     /* CRITICAL SECTION: END */
 
-    if (status == E_OK) {
-        /* Raise priority to the resource priority (priority ceiling protocol) */
-        rp->pre_pri = taskp->pri;
-        taskp->pri  = res_rom[res_id].pri;
-    }
-
-    schedule();
+    /* Raising the priority never preempts the current task, so scheduling is necessary only to wait. */
+    if (blocked)
+        schedule();
 
     return status;
 }
 
-static bool_t task_waiting_for(res_t *rp)
-{
-    return rp->wque.next != &rp->wque;
-}
-
-static void wake_up(res_t *rp)
-{
-    wque_t *wp;
-    task_t *tp;
-    task_type_t task_id;
-    uint32_t res_id = rp - res;
-
-    if (task_waiting_for(rp)) {
-        /* Remove the head of the wait queue to place it in the READY state. */
-        wp             = rp->wque.prev;
-        wp->prev->next = &rp->wque;
-        rp->wque.prev  = wp->prev;
-        wp->next = NULL;
-        wp->prev = NULL;
-
-        /*
-         * Task id that is begin removed from the wait queue can be calculated
-         * by the offset from the beggining of a task array.
-         */
-        task_id = ((size_t)wp - (size_t)task) / sizeof(task_t);
-        tp      = &task[task_id];
-
-        /* Allocate resource for this task */
-        rp->owner = task_id;
-
-        /* Temporarily raise priority (priority ceiling protocol) */
-        rp->pre_pri = tp->pri;
-        tp->pri     = res_rom[res_id].pri;
-
-        tp->state = TASK_STATE_READY;
-    }
-}
-
 status_type_t sys_release_resource(uint32_t res_id)
 {
     status_type_t status = E_OK;
     res_t *rp;
-    task_type_t task_id = taskp - task;
+    int pri;
 
     CHECK_ID(res_id, NR_RES);
 
     rp = &res[res_id];
 
-    if (rp->owner != task_id)
+    /* Resources must be released in the reverse order of allocation. */
+    if (rp != taskp->res_top)
         return E_OS_NOFUNC;
 
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
-    /* Release resource */
-    rp->owner = 0;
+    pri = rp->pre_pri;
+    release(taskp, rp);
 
-    /* Lower priority to the original level */
-    taskp->pri = rp->pre_pri;
-
-    /* Wake up another task if it is waiting for this resoure */
-    wake_up(rp);
+    /*
+     * Lower priority to the original level,
+     * but keep the priority inherited from the tasks waiting for the mutexes still occupied.
+     */
+    for (rp = taskp->res_top; rp; rp = rp->next) {
+        if (task_waiting_for(rp) && wque_to_task(rp->wque.next)->pri < pri)
+            pri = wque_to_task(rp->wque.next)->pri;
+    }
+    change_pri(taskp, pri);
 
     enable_interrupt();
     /* CRITICAL SECTION: END */
@@ -508,6 +1188,31 @@ status_type_t sys_release_resource(uint32_t res_id)
     return status;
 }
 
+static bool_t events_matched(task_t *tp, uint32_t flag)
+{
+    uint32_t wait = tp->ev_wait;
+
+    if (tp->ev_all)
+        return wait && (flag & wait) == wait;
+    else
+        return (flag & wait) != 0;
+}
+
+static void set_return_value(task_t *tp, status_type_t status)
+{
+    /*
+     * Rewrite r0 in the exception frame of the task which is switched out.
+     * The frame is above the context saved by PendSV (and s16-s31 if the FPU context is saved).
+     */
+    uint32_t *sp = (uint32_t *)tp->context;
+
+#ifdef FPU_CONTEXT
+    if (!(sp[8] & 0x10))
+        sp += 16;
+#endif
+    sp[SW_CONTEXT_SIZE] = status;
+}
+
 status_type_t sys_set_event(task_type_t task_id, event_mask_type_t event)
 {
     status_type_t status = E_OK;
@@ -518,22 +1223,30 @@ status_type_t sys_set_event(task_type_t task_id, event_mask_type_t event)
 
     tp = &task[task_id];
 
-    /* CRITICAL SECTION: BEGIN */
-    disable_interrupt();
-
     if (tp->state & TASK_STATE_SUSPENDED)
-        status = E_OS_STATE;
-    else {
-        tp->ev_flag |= event;
-        if ((tp->ev_wait & tp->ev_flag) && (tp->state & TASK_STATE_WAITING)) {
+        return E_OS_STATE;
+
+    /*
+     * Event flags are set without the interrupt lock. ev_wait is not zero only while the task
+     * waits, and wait_event() sets it before checking the flags in its critical section, so
+     * the task never misses the event. The lock is needed only to wake up the task.
+     */
+    if (events_matched(tp, atomic_or(&tp->ev_flag, event))) {
+        /* CRITICAL SECTION: BEGIN */
+        disable_interrupt();
+
+        /* Another event may have woken up the task in the meantime. */
+        if (events_matched(tp, tp->ev_flag) && (tp->state & TASK_STATE_WAITING)) {
             tp->ev_wait = 0;
             tp->state   = TASK_STATE_READY;
+            timer_remove(&tp->timer);
+            ready_enqueue(tp);
             resched = TRUE;
         }
-    }
 
-    enable_interrupt();
-    /* CRITICAL SECTION: END */
+        enable_interrupt();
+        /* CRITICAL SECTION: END */
+    }
 
     if (resched)
         schedule();
@@ -543,7 +1256,8 @@ status_type_t sys_set_event(task_type_t task_id, event_mask_type_t event)
 
 status_type_t sys_clear_event(event_mask_type_t event)
 {
-    taskp->ev_flag &= ~event;
+    /* Events may be set by interrupt handlers at the same time. */
+    atomic_and(&taskp->ev_flag, ~event);
 
     return E_OK;
 }
@@ -571,8 +1285,42 @@ status_type_t sys_get_event(task_type_t task_id, event_mask_type_t *event)
     return status;
 }
 
-status_type_t sys_wait_event(event_mask_type_t event)
+static void wait_timeout(tmr_t *tmrp)
+{
+    task_t *tp = wque_to_task(&tmrp->link);
+    bool_t resched = FALSE;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    /* The task may be woken up by an event after the timer is taken out of the wheel. */
+    if ((tp->state & TASK_STATE_WAITING) && tp->ev_wait) {
+        tp->ev_wait = 0;
+        tp->state   = TASK_STATE_READY;
+        set_return_value(tp, E_OS_TIMEOUT);
+        ready_enqueue(tp);
+        resched = TRUE;
+    }
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    if (resched)
+        schedule();
+}
+
+static status_type_t wait(event_mask_type_t event, bool_t all, tick_t ticks)
 {
+    status_type_t status = E_OK;
+
+    /* Basic tasks cannot wait since they share the stack. */
+    if (task_rom[taskp - task].basic)
+        return E_OS_ACCESS;
+
+    /* A task holding a resource shall not wait, or the resource would be found occupied. */
+    if (taskp->res_top)
+        return E_OS_RESOURCE;
+
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
@@ -582,10 +1330,125 @@ status_type_t sys_wait_event(event_mask_type_t event)
      */
 
     taskp->ev_wait = event;
-    if (taskp->ev_wait & taskp->ev_flag)
-        taskp->state = TASK_STATE_READY;
-    else
+    taskp->ev_all  = all;
+    if (events_matched(taskp, taskp->ev_flag)) {
+        taskp->ev_wait = 0;
+        taskp->state   = TASK_STATE_READY;
+    }
+    else if (ticks == 0) {
+        /* Polling */
+        taskp->ev_wait = 0;
+        status = E_OS_TIMEOUT;
+    }
+    else {
+        ready_remove(taskp);
         taskp->state = TASK_STATE_WAITING;
+        lower_dispatch_pri(taskp);
+        if (ticks != WAIT_FOREVER) {
+            taskp->timer.expire  = task_wheel.now + ticks;
+            taskp->timer.handler = wait_timeout;
+            timer_add(&task_wheel, &taskp->timer);
+        }
+    }
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    schedule();
+
+    /* E_OK is returned if the task waits. It is rewritten by wait_timeout() if the time runs out. */
+    return status;
+}
+
+static void sleep_expire(tmr_t *tmrp)
+{
+    task_t *tp = wque_to_task(&tmrp->link);
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    tp->state = TASK_STATE_READY;
+    ready_enqueue(tp);
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    schedule();
+}
+
+static void sleep_until(tick_t expire)
+{
+    /* Sleeping tasks wait for no event, so they are woken up only by the timer. */
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    ready_remove(taskp);
+    taskp->state = TASK_STATE_WAITING;
+    lower_dispatch_pri(taskp);
+    taskp->timer.expire  = expire;
+    taskp->timer.handler = sleep_expire;
+    timer_add(&task_wheel, &taskp->timer);
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    schedule();
+}
+
+status_type_t sys_sleep_ticks(tick_t ticks)
+{
+    if (task_rom[taskp - task].basic)
+        return E_OS_ACCESS;
+    if (taskp->res_top)
+        return E_OS_RESOURCE;
+
+    if (ticks > 0)
+        sleep_until(task_wheel.now + ticks);
+
+    return E_OK;
+}
+
+status_type_t sys_wait_next_period(tick_t *anchor, tick_t period)
+{
+    /*
+     * The release time is advanced from the anchor, not from the current time,
+     * so the period does not drift by the time taken to call this service.
+     */
+    if (task_rom[taskp - task].basic)
+        return E_OS_ACCESS;
+    if (taskp->res_top)
+        return E_OS_RESOURCE;
+
+    *anchor += period;
+
+    /* The release time has already passed. */
+    if (*anchor - task_wheel.now - 1 >= period)
+        return E_OS_LIMIT;
+
+    sleep_until(*anchor);
+
+    return E_OK;
+}
+
+status_type_t sys_get_systick(tick_t *tick)
+{
+    *tick = systick;
+
+    return E_OK;
+}
+
+status_type_t sys_schedule_task(void)
+{
+    /* Resources must be released before giving up the processor. */
+    if (taskp->res_top)
+        return E_OS_RESOURCE;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    /* Let the tasks above the own priority run, as if the task were preemptive. */
+    lower_dispatch_pri(taskp);
 
     enable_interrupt();
     /* CRITICAL SECTION: END */
@@ -595,6 +1458,21 @@ status_type_t sys_wait_event(event_mask_type_t event)
     return E_OK;
 }
 
+status_type_t sys_wait_event(event_mask_type_t event)
+{
+    return wait(event, FALSE, WAIT_FOREVER);
+}
+
+status_type_t sys_wait_event_all(event_mask_type_t event)
+{
+    return wait(event, TRUE, WAIT_FOREVER);
+}
+
+status_type_t sys_wait_event_timeout(event_mask_type_t event, tick_t ticks)
+{
+    return wait(event, FALSE, ticks);
+}
+
 status_type_t sys_get_alarm_base(uint32_t alarm_id, alarm_base_t *alarm_basep)
 {
     const alarm_base_t *abp;
@@ -654,12 +1532,33 @@ status_type_t sys_get_alarm(uint32_t alarm_id, tick_t *tickp)
 
 void activate_alarm(alarm_t *alarm, alarm_type_t type, tick_t next_count, tick_t cycle)
 {
+    counter_t *cp = alarm->counterp;
+    tick_t count;
+
     alarm->type       = type;
     alarm->next_count = next_count;
     alarm->last_count = 0;
     alarm->cycle      = cycle;
     alarm->expired    = FALSE;
     alarm->state      = ALARM_STATE_ACTIVE;
+
+    /* The alarm for the current counter value expires at the next increment. */
+    count = elapsed_time(next_count, cp->value, cp->alarm_basep->maxallowedvalue);
+    alarm->timer.expire = cp->wheel.now + (count ? count : 1);
+    timer_add(&cp->wheel, &alarm->timer);
+}
+
+static bool_t alarm_value_valid(alarm_t *ap, tick_t count, tick_t cycle)
+{
+    /* Values are limited by the counter which the alarm is tied up. */
+    const alarm_base_t *abp = ap->counterp->alarm_basep;
+
+    if (count > abp->maxallowedvalue)
+        return FALSE;
+    if (cycle && (cycle < abp->mincycle || cycle > abp->maxallowedvalue))
+        return FALSE;
+
+    return TRUE;
 }
 
 status_type_t sys_set_rel_alarm(uint32_t alarm_id, tick_t increment, tick_t cycle)
@@ -672,13 +1571,17 @@ status_type_t sys_set_rel_alarm(uint32_t alarm_id, tick_t increment, tick_t cycl
 
     ap = &alarm[alarm_id];
 
+    /* An increment of zero would be the current counter value, which OSEK rejects. */
+    if (increment == 0 || !alarm_value_valid(ap, increment, cycle))
+        return E_OS_VALUE;
+
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
     if (ap->state == ALARM_STATE_ACTIVE)
         status = E_OS_STATE;
     else {
-        next_count = ap->counterp->value + increment;
+        next_count = count_add(ap->counterp->value, increment, ap->counterp->alarm_basep->maxallowedvalue);
         activate_alarm(ap, ALARM_TYPE_REL, next_count, cycle);
     }
 
@@ -697,6 +1600,9 @@ status_type_t sys_set_abs_alarm(uint32_t alarm_id, tick_t start, tick_t cycle)
 
     ap = &alarm[alarm_id];
 
+    if (!alarm_value_valid(ap, start, cycle))
+        return E_OS_VALUE;
+
     /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
 
@@ -713,7 +1619,7 @@ status_type_t sys_set_abs_alarm(uint32_t alarm_id, tick_t start, tick_t cycle)
 
 status_type_t sys_cancel_alarm(uint32_t alarm_id)
 {
-    status_type_t status;
+    status_type_t status = E_OK;
     alarm_t *ap;
 
     CHECK_ID(alarm_id, NR_ALARM);
@@ -725,8 +1631,10 @@ status_type_t sys_cancel_alarm(uint32_t alarm_id)
 
     if (ap->state == ALARM_STATE_FREE)
         status = E_OS_STATE;
-    else
+    else {
         ap->state = ALARM_STATE_FREE;
+        timer_remove(&ap->timer);
+    }
 
     enable_interrupt();
     /* CRITICAL SECTION: END */
@@ -734,9 +1642,183 @@ status_type_t sys_cancel_alarm(uint32_t alarm_id)
     return status;
 }
 
+status_type_t sys_increment_counter(uint32_t counter_id)
+{
+    counter_t *cp;
+
+    CHECK_ID(counter_id, NR_COUNTER);
+
+    cp = &counter[counter_id];
+
+    /* Hardware counters are incremented only by SysTick_Handler. */
+    if (cp->type != COUNTER_TYPE_SOFTWARE)
+        return E_OS_ID;
+
+    counter_increment(cp);
+
+    return E_OK;
+}
+
+#ifdef TICKLESS_IDLE
+static tick_t ticks_to_next_alarm(void)
+{
+    counter_t *cp;
+    const alarm_base_t *abp;
+    tick_t ticks = TICK_MAX;
+    tick_t count;
+    tick_t left;
+
+    for (cp = counter; cp < counter + NR_COUNTER; cp++) {
+        if (cp->type != COUNTER_TYPE_HARDWARE)
+            continue;
+
+        abp   = cp->alarm_basep;
+        count = timer_next(&cp->wheel);
+        if (count == TICK_MAX)
+            continue;
+
+        /* The wheel is advanced in the tick where the counter is incremented. */
+        left = cp->next_tick - systick;
+        if (count - 1 > (TICK_MAX - left) / abp->ticksperbase)
+            continue;
+        left += (count - 1) * abp->ticksperbase;
+
+        if (left < ticks)
+            ticks = left;
+    }
+
+    /* The wheel of the task timeouts is advanced every tick. */
+    count = timer_next(&task_wheel);
+    if (count != TICK_MAX && count - 1 < ticks)
+        ticks = count - 1;
+
+    return ticks;
+}
+
+static void skip_ticks(tick_t ticks)
+{
+    /*
+     * Advance systick and counters by the ticks for which SysTick_Handler was not invoked.
+     * No alarm expires in those ticks, so the counter values and the time of the wheels are
+     * only corrected.
+     */
+    counter_t *cp;
+    const alarm_base_t *abp;
+    tick_t due;
+    tick_t count;
+
+    for (cp = counter; cp < counter + NR_COUNTER; cp++) {
+        if (cp->type != COUNTER_TYPE_HARDWARE)
+            continue;
+
+        abp = cp->alarm_basep;
+        due = cp->next_tick - systick;
+        if (due >= ticks)
+            continue;
+
+        count = (ticks - 1 - due) / abp->ticksperbase + 1;
+        cp->next_tick += count * abp->ticksperbase;
+        cp->last_tick  = cp->next_tick - abp->ticksperbase;
+        cp->value      = count_add(cp->value, count, abp->maxallowedvalue);
+        cp->wheel.now += count;
+    }
+
+    systick        += ticks;
+    task_wheel.now += ticks;
+}
+
+static void idle(void)
+{
+    /*
+     * Stop the periodic tick while the processor sleeps.
+     * SysTick is reprogrammed to expire at the tick where the nearest alarm is checked,
+     * and systick and counters are corrected by the ticks slept when the processor wakes up.
+     */
+    uint32_t period = systick_rvr + 1;
+    uint32_t csr;
+    uint32_t rest;
+    uint32_t sleep;
+    uint32_t elapsed;
+    uint32_t left;
+    tick_t max_ticks = SYST_RVR_MAX / period;
+    tick_t ticks;
+    tick_t skipped;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    ticks = ticks_to_next_alarm();
+    if (ticks >= max_ticks)
+        ticks = max_ticks ? max_ticks - 1 : 0;
+
+    if (ticks == 0) {
+        /* The next tick has work to do. Sleep until it comes as usual. */
+        wait_for_interrupt();
+        enable_interrupt();
+        return;
+    }
+
+    /* Reading CSR clears COUNTFLAG, so it is read only once. */
+    csr = SYST_CSR;
+    SYST_CSR = csr & ~SYST_CSR_ENABLE;
+    if ((csr & SYST_CSR_COUNTFLAG) || (ICSR & ICSR_PENDSTSET)) {
+        /* The tick has just expired. Handle it before sleeping. */
+        SYST_CSR |= SYST_CSR_ENABLE;
+        enable_interrupt();
+        return;
+    }
+
+    /* Sleep until the end of the current tick and the following ticks */
+    rest  = SYST_CVR;
+    sleep = rest + ticks * period;
+    SYST_RVR = sleep - 1;
+    SYST_CVR = 0;
+    SYST_CSR |= SYST_CSR_ENABLE;
+
+    wait_for_interrupt();
+
+    csr = SYST_CSR;
+    SYST_CSR = csr & ~SYST_CSR_ENABLE;
+    elapsed = sleep - 1 - SYST_CVR;
+    if ((csr & SYST_CSR_COUNTFLAG) || (ICSR & ICSR_PENDSTSET)) {
+        /*
+         * Woken up by SysTick. The pending SysTick_Handler processes the last tick, and
+         * the counter has been reloaded and counting since then, i.e. elapsed is the time
+         * passed in the next tick.
+         */
+        left    = (elapsed < period) ? period - elapsed : period;
+        skipped = ticks;
+    }
+    else if (elapsed < rest) {
+        /* Woken up by another interrupt in the tick where the sleep began */
+        left    = rest - elapsed;
+        skipped = 0;
+    }
+    else {
+        /* Woken up by another interrupt. Only the completed ticks are skipped. */
+        elapsed -= rest;
+        left     = period - elapsed % period;
+        skipped  = elapsed / period + 1;
+    }
+    SYST_RVR = (left > 1) ? left - 1 : 1;
+    SYST_CVR = 0;
+    SYST_CSR |= SYST_CSR_ENABLE;
+    SYST_RVR = systick_rvr;
+
+    skip_ticks(skipped);
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+}
+#endif
+
 void default_task(int ex)
 {
-    while (1) ;
+    while (1) {
+#ifdef TICKLESS_IDLE
+        idle();
+#endif
+    }
 }
 
 void initialize_object(void)
@@ -744,41 +1826,56 @@ void initialize_object(void)
     int i;
     task_t *tp;
 
+    /* Ready queue */
+    for (i = 0; i < NR_PRI; i++) {
+        ready_que.que[i].next = &ready_que.que[i];
+        ready_que.que[i].prev = &ready_que.que[i];
+    }
+
     /* Initialize user tasks */
     for (i = 0; i < NR_TASK; i++) {
         tp = task + i;
-        init_task(tp, TASK_STATE_SUSPENDED);
-        if (task_rom[i].autostart) {
-            tp->state = TASK_STATE_READY;
-        }
+        init_task(tp, task_rom[i].autostart ? TASK_STATE_READY : TASK_STATE_SUSPENDED);
     }
 
-    /* Set up PSP to default task. */
-    set_psp((uint32_t *)task[0].context + 8);
-
     /* Wait queue */
     for (i = 0; i < NR_RES; i++) {
         res[i].wque.next = &res[i].wque;
         res[i].wque.prev = &res[i].wque;
     }
 
-    /* Create counter */
-    counter[0].alarm_basep = &alarm_base[0];
+    /* Set up PSP to default task. The context saved by the first dispatch is discarded. */
+    set_psp(task_rom[0].stack_bottom);
+
+    /* Create counters */
     for (i = 0; i < NR_COUNTER; i++) {
+        counter[i].type = counter_rom[i].type;
+        counter[i].alarm_basep = &counter_rom[i].alarm_base;
         counter[i].value = 0;
         counter[i].next_tick = counter[i].alarm_basep->ticksperbase;
         counter[i].last_tick = 0;
+        timer_wheel_init(&counter[i].wheel);
     }
 
+    /* Timeouts of the tasks */
+    timer_wheel_init(&task_wheel);
+
     /* Initialize alarms */
     for (i = 0; i < NR_ALARM; i++) {
         alarm[i].state = ALARM_STATE_FREE;
         alarm[i].expired = FALSE;
-        alarm[i].counterp = &counter[0];
+        alarm[i].counterp = &counter[alarm_rom[i].counter_id];
+        alarm[i].timer.handler = alarm_expire;
     }
 
-    taskp = &task[0];
-    schedule();
+    /*
+     * Interrupts are still disabled here, so the first dispatch is done
+     * by PendSV as soon as start_os() enables interrupts.
+     */
+    taskp      = &task[0];
+    taskp_next = ready_highest();
+    taskp_next->state = TASK_STATE_RUNNING;
+    pend_sv();
 }
 
 __attribute__((naked))
@@ -789,7 +1886,8 @@ void start_os(void)
     initialize_object();
 
     /* Enable systick interrupt */
-    SYST_RVR = SYST_CALIB * 1;
+    systick_rvr = SYST_CALIB * 1;
+    SYST_RVR = systick_rvr;
     SYST_CSR = 0x00000007;
 
     enable_interrupt();
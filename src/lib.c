@@ -1,9 +1,14 @@
 #include "uros.h"
 #include "uart.h"
 #include "uart_hal.h"
+#include "config.h"
 
 #define HEAP_SIZE 4096 /* KB */
 #define HEAP_UNIT_SIZE sizeof(cell_t)
+#define STDOUT_BUF_SIZE 64
+#define GETS_CHUNK_SIZE 64
+
+status_type_t sys_get_task_id(task_type_t *task_id);
 
 typedef struct cell {
     struct cell *next;
@@ -13,6 +18,14 @@ typedef struct cell {
 static cell_t heap[HEAP_SIZE/HEAP_UNIT_SIZE + 1]; /* includes sentinel */
 static cell_t *freep;
 
+/* Buffer of the standard output for each task */
+typedef struct {
+    size_t len;
+    char   buf[STDOUT_BUF_SIZE];
+} stdout_t;
+
+static stdout_t stdout_buf[NR_TASK];
+
 void *memset(void *b, int c, size_t len)
 {
     char *p = (char *)b;
@@ -129,86 +142,152 @@ size_t strlen(const char *s)
     return p - s;
 }
 
-void uart_put_str(char *s, size_t size)
+static uint32_t console_open(void)
 {
+    static bool_t opened = FALSE;
     uart_info_t info;
-    uint32_t devno;
 
 #ifdef LM3S6965EVB
-    devno = 0;
+    info.devno = 0;
 #elif  STM32F407xx
-    devno = 1;
+    info.devno = 1;
 #endif
-    info.devno = devno;
     info.baud_rate = 115200;
+    info.flags = UART_FLAG_CANON | UART_FLAG_ECHO;
+
+    /* The console is opened only once, and uart_open() ignores the second open by other tasks. */
+    if (!opened) {
+        uart_open(&info);
+        opened = TRUE;
+    }
+
+    return info.devno;
+}
 
-    uart_open(&info);
-    uart_write(devno, s, size);
-    /* uart_close(&info); */
+int uart_put_str(char *s, size_t size)
+{
+    return uart_write(console_open(), s, size);
 }
 
 int uart_get_str(char *s, size_t size)
 {
-    uart_info_t info;
-    uint32_t devno;
-    int ret;
+    /* The driver echoes the input and gives it when a line is completed. */
+    return uart_read(console_open(), s, size);
+}
 
-#ifdef LM3S6965EVB
-    devno = 0;
-#elif  STM32F407xx
-    devno = 1;
-#endif
-    info.devno = devno;
-    info.baud_rate = 115200;
+static stdout_t *stdout_of_task(void)
+{
+    task_type_t task_id;
 
-    uart_open(&info);
-    if ((ret = uart_tread(devno, s, size, 40)) == -1)
-        *s = '.';
-    /* uart_close(&info); */
-    return ret;
+    /* The current task is read without the system call, since this is done for each character. */
+    sys_get_task_id(&task_id);
+    return &stdout_buf[task_id];
 }
 
-void putc(char c)
+static void out_flush(stdout_t *out)
 {
-    uart_put_str(&c, 1);
+    /* The whole run of characters is handed to the driver at once, and the unsent ones are kept. */
+    int n;
+    size_t i;
+
+    if (out->len) {
+        n = uart_put_str(out->buf, out->len);
+        if (n <= 0)
+            return;
+        out->len -= n;
+        for (i = 0; i < out->len; i++)
+            out->buf[i] = out->buf[i + n];
+    }
 }
 
-void putchar(char c)
+static void out_putc(stdout_t *out, char c)
 {
-    putc(c);
-    if (c == '\n')
-        putc('\r');
+    /* The character is lost if the buffer could not be flushed. */
+    if (out->len == STDOUT_BUF_SIZE)
+        return;
+
+    out->buf[out->len++] = c;
+    if (out->len == STDOUT_BUF_SIZE)
+        out_flush(out);
 }
 
-void puts(const char *s)
+static void out_putchar(stdout_t *out, char c)
+{
+    /* Output is line buffered. */
+    out_putc(out, c);
+    if (c == '\n') {
+        out_putc(out, '\r');
+        out_flush(out);
+    }
+}
+
+static void out_puts(stdout_t *out, const char *s)
 {
     while (*s)
-        putchar(*s++);
-    putchar('\n');
+        out_putchar(out, *s++);
 }
 
-void putdec(unsigned int n)
+static void out_putdec(stdout_t *out, unsigned int n)
 {
     if (n < 10)
-        putchar("0123456789"[n]);
+        out_putchar(out, "0123456789"[n]);
     else {
-        putdec(n / 10);
-        putdec(n % 10);
+        out_putdec(out, n / 10);
+        out_putdec(out, n % 10);
     }
 }
 
-void puthex(unsigned int n)
+static void out_puthex(stdout_t *out, unsigned int n)
 {
     if (n < 16)
-        putchar("0123456789ABCDEF"[n]);
+        out_putchar(out, "0123456789ABCDEF"[n]);
     else {
-        puthex(n >> 4);
-        puthex(n & 0xF);
+        out_puthex(out, n >> 4);
+        out_puthex(out, n & 0xF);
     }
 }
 
+void stdout_discard(task_type_t task_id)
+{
+    stdout_buf[task_id].len = 0;
+}
+
+void flush(void)
+{
+    out_flush(stdout_of_task());
+}
+
+void putc(char c)
+{
+    out_putc(stdout_of_task(), c);
+}
+
+void putchar(char c)
+{
+    out_putchar(stdout_of_task(), c);
+}
+
+void puts(const char *s)
+{
+    stdout_t *out = stdout_of_task();
+
+    out_puts(out, s);
+    out_putchar(out, '\n');
+}
+
+void putdec(unsigned int n)
+{
+    out_putdec(stdout_of_task(), n);
+}
+
+void puthex(unsigned int n)
+{
+    out_puthex(stdout_of_task(), n);
+}
+
 void puthex_n(unsigned int n, int column)
 {
+    stdout_t *out = stdout_of_task();
     unsigned int d = n;
     int zlen = column - 1;
 
@@ -217,14 +296,16 @@ void puthex_n(unsigned int n, int column)
         zlen--;
     }
     while (zlen-- > 0)
-        putchar('0');
-    puthex(n);
+        out_putchar(out, '0');
+    out_puthex(out, n);
 }
 
 char getc()
 {
     char c;
 
+    /* Show the prompt before waiting for input */
+    flush();
     uart_get_str(&c, 1);
 
     return c;
@@ -232,21 +313,24 @@ char getc()
 
 char getchar()
 {
-    char c = getc();
-
-    c = (c == '\r') ? '\n' : c;
-    putchar(c);
-
-    return c;
+    return getc();
 }
 
 char* gets(char *s)
 {
+    /* The task is woken up once per line, or per piece of a line longer than the driver buffer. */
     char *p = s;
-    char c;
+    int n;
 
-    while ((c = getchar()) != '\n')
-        *p++ = c;
+    flush();
+    do {
+        if ((n = uart_read_line(console_open(), p, GETS_CHUNK_SIZE)) <= 0)
+            break;
+        p += n;
+    } while (p[-1] != '\n');
+
+    if (p > s && p[-1] == '\n')
+        p--;
     *p = '\0';
 
     return s;
@@ -254,6 +338,7 @@ char* gets(char *s)
 
 void printf(char *fmt, ...)
 {
+    stdout_t *out = stdout_of_task();
     char **argp = &fmt + 1;
     char *p;
 
@@ -261,26 +346,24 @@ void printf(char *fmt, ...)
         if (*p == '%') {
             switch (*++p) {
             case 'c': {
-                putchar((int)*argp);
+                out_putchar(out, (int)*argp);
                 break;
             }
             case 's': {
-                char *s = *argp;
-                while (*s)
-                    putchar(*s++);
+                out_puts(out, *argp);
                 break;
             }
             case 'd': {
-                putdec((int)*argp);
+                out_putdec(out, (int)*argp);
                 break;
             }
             case 'x':
             case 'X': {
-                puthex((int)*argp);
+                out_puthex(out, (int)*argp);
                 break;
             }
             default: {
-                putchar(*p);
+                out_putchar(out, *p);
                 break;
             }
             }
@@ -289,14 +372,14 @@ void printf(char *fmt, ...)
         else if (*p == '\\') {
             switch (*++p) {
             case 'n':
-                putchar('\n');
+                out_putchar(out, '\n');
                 break;
             case 't':
-                putchar('\t');
+                out_putchar(out, '\t');
                 break;
             }
         }
         else
-            putchar(*p);
+            out_putchar(out, *p);
     }
 }
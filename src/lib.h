@@ -2,6 +2,7 @@
 #define LIB_H
 
 #include "stdtype.h"
+#include "uros.h"
 
 void *memset(void *b, int c, size_t len);
 void *memcpy(void *dst, const void *src, size_t n);
@@ -9,6 +10,8 @@ void *memcpy(void *dst, const void *src, size_t n);
 void *mem_alloc(size_t size);
 void mem_free(void *addr);
 
+void flush(void);
+void stdout_discard(task_type_t task_id);
 void putchar(char c);
 void puts(const char *s);
 void putdec(unsigned int n);
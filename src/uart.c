@@ -6,109 +6,331 @@
 #include "config.h"
 
 status_type_t sys_set_event(task_type_t task_id, event_mask_type_t event);
+status_type_t sys_set_rel_alarm(uint32_t alarm_id, tick_t increment, tick_t cycle);
+status_type_t sys_cancel_alarm(uint32_t alarm_id);
+
+#define NR_UART_DEV 5
+#define UART_RING_SIZE 64 /* Power of 2 */
+#define UART_RING_MASK (UART_RING_SIZE - 1)
+#define UART_WAIT_REFUSED (-3)
+
+/* Ring buffer indexed by free running counts */
+typedef struct {
+    uint32_t head; /* Count of the bytes put */
+    uint32_t tail; /* Count of the bytes got */
+    char     buf[UART_RING_SIZE];
+} uart_ring_t;
+
+/* State of a device kept from uart_open() to uart_close() */
+typedef struct {
+    bool_t      opened;
+    uint32_t    baud_rate;
+    uint32_t    flags;        /* UART_FLAG_XXX */
+    uart_ring_t send_ring;    /* Bytes written and not yet given to the hardware */
+    uart_ring_t recv_ring;    /* Bytes received and not yet read */
+    uint32_t    recv_end;     /* End of the bytes given to readers, i.e. of the last line in canonical mode */
+    bool_t      recv_cr;      /* The last byte received was CR */
+    uint32_t    recv_dropped; /* Bytes lost because the receive ring was full */
+    uart_que_t  send_que;     /* Writers waiting for room of the send ring */
+    uart_que_t  recv_que;     /* Readers waiting for bytes */
+} uart_dev_t;
+
+static uart_dev_t uart_dev[NR_UART_DEV];
+static uint32_t timed_requests; /* Requests waiting with timeout */
+
+static void uart_enqueue(uart_que_t *head, uart_que_t *q)
+{
+    /* This function shall be called in critical section. */
+    q->next = head->next;
+    q->prev = head;
+    head->next->prev = q;
+    head->next = q;
+
+    /* UART_ALARM runs only while any timed request is pending. */
+    if (q->timeout && timed_requests++ == 0)
+        sys_set_rel_alarm(UART_ALARM, 1, 1);
+}
 
-static uart_que_t send_que;
-static uart_que_t recv_que;
-static bool_t uart_initialized[] = {FALSE, FALSE, FALSE};
+static void uart_dequeue(uart_que_t *q)
+{
+    /* This function shall be called in critical section. */
+    q->next->prev = q->prev;
+    q->prev->next = q->next;
+    q->next = q;
+    q->prev = q;
+
+    if (q->timeout && --timed_requests == 0)
+        sys_cancel_alarm(UART_ALARM);
+}
 
-void uart_alarm_callback(void)
+static size_t ring_put(uart_ring_t *rp, const char *buf, size_t size)
 {
-    uart_que_t *send_q = send_que.prev;
-    uart_que_t *recv_q = recv_que.prev;
+    size_t n = 0;
 
-    disable_interrupt();
-    while (send_q != &send_que) {
-        if (send_q->timeout && (send_q->over-- == 0)) {
-            send_q->next->prev = send_q->prev;
-            send_q->prev->next = send_q->next;
-            sys_set_event(send_q->task_id, EV_UART_TIMEOUT);
+    while (n < size && rp->head - rp->tail < UART_RING_SIZE)
+        rp->buf[rp->head++ & UART_RING_MASK] = buf[n++];
+    return n;
+}
+
+static uart_que_t *uart_oldest(uart_que_t *head)
+{
+    /* Requests are served in FIFO order, i.e. from the tail of the queue. */
+    return (head->prev != head) ? head->prev : NULL;
+}
+
+static void uart_que_tick(uart_que_t *head)
+{
+    /* This function shall be called in critical section. */
+    uart_que_t *q = head->prev;
+    uart_que_t *prev;
+
+    while (q != head) {
+        prev = q->prev;
+        if (q->timeout && (q->over-- == 0)) {
+            uart_dequeue(q);
+            sys_set_event(q->task_id, EV_UART_TIMEOUT);
         }
-        send_q = send_q->prev;
+        q = prev;
     }
-    while (recv_q != &recv_que) {
-        if (recv_q->timeout && (recv_q->over-- == 0)) {
-            recv_q->next->prev = recv_q->prev;
-            recv_q->prev->next = recv_q->next;
-            sys_set_event(recv_q->task_id, EV_UART_TIMEOUT);
+}
+
+void uart_alarm_callback(void)
+{
+    uint32_t devno;
+
+    disable_interrupt();
+    for (devno = 0; devno < NR_UART_DEV; devno++) {
+        if (uart_dev[devno].opened) {
+            uart_que_tick(&uart_dev[devno].send_que);
+            uart_que_tick(&uart_dev[devno].recv_que);
         }
-        recv_q = recv_q->prev;
     }
     enable_interrupt();
 }
 
-void uart_send_cbr(void)
+static void uart_send_drain(uint32_t devno)
 {
+    /* This function shall be called in critical section. */
+    uart_ring_t *rp = &uart_dev[devno].send_ring;
+
+    /* Fill the hardware FIFO as long as it accepts. */
+    while (rp->head != rp->tail) {
+        if (!uart_hal_send(devno, rp->buf[rp->tail & UART_RING_MASK]))
+            break;
+        rp->tail++;
+    }
+}
+
+static void uart_send_fill(uint32_t devno)
+{
+    /* This function shall be called in critical section. */
+    uart_ring_t *rp = &uart_dev[devno].send_ring;
     uart_que_t *q;
-    bool_t wakeup = FALSE;
-    
+    size_t n;
+
+    /* A writer is woken up when all of its bytes are copied to the ring. */
+    while ((q = uart_oldest(&uart_dev[devno].send_que)) != NULL) {
+        n = ring_put(rp, q->buf, q->size);
+        q->buf  += n;
+        q->size -= n;
+        if (q->size)
+            break;
+        uart_dequeue(q);
+        sys_set_event(q->task_id, EV_UART_COMPLETE);
+    }
+}
+
+void uart_send_cbr(uint32_t devno)
+{
+    /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
-    if (send_que.prev != &send_que) {
-        q = send_que.prev;
-        if (--q->size == 0) {
-            q->next->prev = q->prev;
-            q->prev->next = q->next;
-            wakeup = TRUE;
+    uart_send_fill(devno);
+    uart_send_drain(devno);
+    uart_send_fill(devno);
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+}
+
+static size_t uart_recv_take(uart_dev_t *dp, uart_que_t *q)
+{
+    /*
+     * Move the received bytes up to recv_end to the request.
+     * A line request is completed by a newline as well as by the full buffer.
+     * This function shall be called in critical section.
+     */
+    uart_ring_t *rp = &dp->recv_ring;
+    size_t n = 0;
+    char c;
+
+    while (q->size && rp->tail != dp->recv_end) {
+        c = rp->buf[rp->tail++ & UART_RING_MASK];
+        *q->buf++ = c;
+        q->size--;
+        n++;
+        if (q->line && c == '\n') {
+            q->line = FALSE;
+            q->size = 0;
         }
-        else
-            uart_hal_send(q->devno, *++q->buf);
     }
-    enable_interrupt();
-    
-    if (wakeup)
-        sys_set_event(q->task_id, EV_UART_COMPLETE);
+    return n;
 }
 
-void uart_recv_cbr(void)
+static void uart_recv_fill(uint32_t devno)
 {
+    /* This function shall be called in critical section. */
+    uart_dev_t *dp = &uart_dev[devno];
     uart_que_t *q;
-    bool_t wakeup = FALSE;
 
+    while ((q = uart_oldest(&dp->recv_que)) != NULL) {
+        uart_recv_take(dp, q);
+        if (q->size)
+            break;
+        uart_dequeue(q);
+        sys_set_event(q->task_id, EV_UART_COMPLETE);
+    }
+}
+
+static void uart_echo(uint32_t devno, const char *s, size_t size)
+{
+    /* This function shall be called in critical section. */
+    if (uart_dev[devno].flags & UART_FLAG_ECHO) {
+        ring_put(&uart_dev[devno].send_ring, s, size);
+        uart_send_drain(devno);
+    }
+}
+
+static void uart_canon_input(uint32_t devno, char c)
+{
+    /* This function shall be called in critical section. */
+    uart_dev_t *dp = &uart_dev[devno];
+    uart_ring_t *rp = &dp->recv_ring;
+
+    /* CR, LF and CRLF all end a line. */
+    if (c == '\n' && dp->recv_cr) {
+        dp->recv_cr = FALSE;
+        return;
+    }
+    dp->recv_cr = (c == '\r');
+    if (c == '\r')
+        c = '\n';
+
+    if (c == '\b' || c == 0x7F) {
+        /* Erase the last character of the line being edited. */
+        if (rp->head != dp->recv_end) {
+            rp->head--;
+            uart_echo(devno, "\b \b", 3);
+        }
+        return;
+    }
+
+    if (!ring_put(rp, &c, 1)) {
+        dp->recv_dropped++;
+        return;
+    }
+
+    if (c == '\n') {
+        uart_echo(devno, "\r\n", 2);
+        dp->recv_end = rp->head;
+    }
+    else
+        uart_echo(devno, &c, 1);
+
+    /* A line longer than the ring is given to readers in pieces. */
+    if (rp->head - rp->tail == UART_RING_SIZE)
+        dp->recv_end = rp->head;
+}
+
+void uart_recv_cbr(uint32_t devno)
+{
+    uart_dev_t *dp = &uart_dev[devno];
+    char c;
+
+    /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
-    if (recv_que.prev != &recv_que) {
-        q = recv_que.prev;
-        uart_hal_recv(q->devno, q->buf++);
-        if (--q->size == 0) {
-            q->next->prev = q->prev;
-            q->prev->next = q->next;
-            wakeup = TRUE;
+
+    /* The hardware FIFO is emptied even if no reader is waiting. */
+    while (uart_hal_recv(devno, &c)) {
+        if (dp->flags & UART_FLAG_CANON)
+            uart_canon_input(devno, c);
+        else {
+            if (!ring_put(&dp->recv_ring, &c, 1))
+                dp->recv_dropped++;
+            else if (dp->flags & UART_FLAG_ECHO)
+                uart_echo(devno, &c, 1);
+            dp->recv_end = dp->recv_ring.head;
         }
     }
-    enable_interrupt();
 
-    if (wakeup)
-        sys_set_event(q->task_id, EV_UART_COMPLETE);
+    /* Readers are woken up only when a line is completed in canonical mode. */
+    uart_recv_fill(devno);
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
 }
 
 int uart_open(uart_info_t *dev)
 {
+    /*
+     * A device is set up only by the first open, and later opens return at once.
+     * Reads and writes use the state kept here without any setup.
+     */
     uart_hal_oinfo_t oinfo;
-    
+    uart_dev_t *dp;
+    int ret = 0;
+
+    if (dev->devno >= NR_UART_DEV)
+        return -1;
+
     oinfo.baud_rate = dev->baud_rate;
-    oinfo.pri = 1;
+    oinfo.pri = KERNEL_INTERRUPT_PRI;
     oinfo.send_cbr = uart_send_cbr;
     oinfo.recv_cbr = uart_recv_cbr;
 
-    uart_hal_open(dev->devno, &oinfo);
-    uart_hal_enable_cbr(dev->devno, UART_HAL_CBR_FLAG_SEND);
-    uart_hal_enable_cbr(dev->devno, UART_HAL_CBR_FLAG_RECV);
-
+    /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
-    if (uart_initialized[dev->devno] == FALSE) {
-        send_que.next = &send_que;
-        send_que.prev = &send_que;
-        recv_que.next = &recv_que;
-        recv_que.prev = &recv_que;
-        uart_initialized[dev->devno] = TRUE;
+
+    dp = &uart_dev[dev->devno];
+    if (!dp->opened) {
+        dp->baud_rate = dev->baud_rate;
+        dp->flags = dev->flags;
+        dp->send_ring.head = 0;
+        dp->send_ring.tail = 0;
+        dp->recv_ring.head = 0;
+        dp->recv_ring.tail = 0;
+        dp->recv_end = 0;
+        dp->recv_cr = FALSE;
+        dp->recv_dropped = 0;
+        dp->send_que.next = &dp->send_que;
+        dp->send_que.prev = &dp->send_que;
+        dp->recv_que.next = &dp->recv_que;
+        dp->recv_que.prev = &dp->recv_que;
+
+        if (uart_hal_open(dev->devno, &oinfo) == 0) {
+            uart_hal_enable_cbr(dev->devno, UART_HAL_CBR_FLAG_SEND);
+            uart_hal_enable_cbr(dev->devno, UART_HAL_CBR_FLAG_RECV);
+            dp->opened = TRUE;
+        }
+        else
+            ret = -1;
     }
+
     enable_interrupt();
-    
-    set_abs_alarm(UART_ALARM, 0, 1);
+    /* CRITICAL SECTION: END */
 
-    return 0;
+    return ret;
 }
 
 int uart_close(uart_info_t *dev)
 {
+    if (dev->devno >= NR_UART_DEV)
+        return -1;
+
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+    uart_dev[dev->devno].opened = FALSE;
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
     return uart_hal_close(dev->devno);
 }
 
@@ -121,48 +343,61 @@ task_type_t task_id(void)
     return id;
 }
 
-void uart_send_request(uint32_t devno, char *buf, size_t size, uart_que_t *que)
-{
-    que->devno = devno;
-    que->buf = buf;
-    que->size = size;
-    que->task_id = task_id();
-
-    disable_interrupt();
-    /* enqueue */
-    que->next = send_que.next;
-    que->prev = &send_que;
-    send_que.next->prev = que;
-    send_que.next = que;
-    uart_hal_send(devno, *buf);
-    enable_interrupt();
-}
-
-int uart_write(uint32_t devno, char *buf, size_t size)
+static void uart_send_poll(uint32_t devno, uart_que_t *q)
 {
-    return uart_twrite(devno, buf, size, 0);
+    /* The bytes are put in the send ring as the hardware takes the preceding ones. */
+    size_t n;
+
+    while (q->size) {
+        /* CRITICAL SECTION: BEGIN */
+        disable_interrupt();
+        uart_send_drain(devno);
+        n = ring_put(&uart_dev[devno].send_ring, q->buf, q->size);
+        uart_send_drain(devno);
+        enable_interrupt();
+        /* CRITICAL SECTION: END */
+
+        q->buf  += n;
+        q->size -= n;
+    }
 }
 
-int uart_twrite(uint32_t devno, char *buf, size_t size, tick_t over)
+static int uart_wait(uart_que_t *q, tick_t over)
 {
-    uart_que_t que;
+    /*
+     * Wait until the request queued by the caller is completed.
+     * The request lives in the stack frame of the caller, so it is taken out of the queue
+     * if the caller cannot wait, e.g. a basic task or a task holding a resource.
+     * Return 0 when completed, -1 on timeout, -2 on error, or UART_WAIT_REFUSED if the caller
+     * cannot wait.
+     */
     event_mask_type_t event;
+    status_type_t status;
+    bool_t queued = FALSE;
 
     if (over > 0)
-        que.timeout = TRUE;
+        status = wait_event(EV_UART_COMPLETE | EV_UART_TIMEOUT);
     else
-        que.timeout = FALSE;
-    que.over = over;
-    uart_send_request(devno, buf, size, &que);
-
-    if (over > 0)
-        wait_event(EV_UART_COMPLETE | EV_UART_TIMEOUT);
-    else
-        wait_event(EV_UART_COMPLETE);
+        status = wait_event(EV_UART_COMPLETE);
+
+    if (status != E_OK) {
+        /* CRITICAL SECTION: BEGIN */
+        disable_interrupt();
+        if (q->next != q) {
+            uart_dequeue(q);
+            queued = TRUE;
+        }
+        enable_interrupt();
+        /* CRITICAL SECTION: END */
+    }
 
     get_event(task_id(), &event);
+    event &= EV_UART_COMPLETE | EV_UART_TIMEOUT;
     clear_event(event);
 
+    if (queued)
+        return UART_WAIT_REFUSED;
+
     if (over > 0) {
         if (event & EV_UART_TIMEOUT)
             return -1;
@@ -170,56 +405,116 @@ int uart_twrite(uint32_t devno, char *buf, size_t size, tick_t over)
     else if (!(event & EV_UART_COMPLETE))
         return -2;
 
-    return size - que.size;
+    return 0;
 }
 
-void uart_recv_request(uint32_t devno, char *buf, size_t size, uart_que_t *que)
+int uart_write(uint32_t devno, char *buf, size_t size)
 {
-    que->devno = devno;
-    que->buf = buf;
-    que->size = size;
-    que->task_id = task_id();
+    return uart_twrite(devno, buf, size, 0);
+}
 
+int uart_twrite(uint32_t devno, char *buf, size_t size, tick_t over)
+{
+    /*
+     * The bytes are copied to the send ring and the writer returns at once if all of them fit.
+     * Otherwise the rest is queued and the writer waits until the ring takes it.
+     */
+    uart_que_t que;
+    int ret;
+    size_t n = 0;
+
+    if (devno >= NR_UART_DEV || !uart_dev[devno].opened)
+        return -2;
+
+    /* CRITICAL SECTION: BEGIN */
     disable_interrupt();
-    /* enqueue */
-    que->next = recv_que.next;
-    que->prev = &recv_que;
-    recv_que.next->prev = que;
-    recv_que.next = que;
+
+    /* Bytes shall not overtake the ones of the preceding writers. */
+    if (uart_oldest(&uart_dev[devno].send_que) == NULL)
+        n = ring_put(&uart_dev[devno].send_ring, buf, size);
+    if (n < size) {
+        que.devno   = devno;
+        que.buf     = buf + n;
+        que.size    = size - n;
+        que.timeout = (over > 0) ? TRUE : FALSE;
+        que.over    = over;
+        que.task_id = task_id();
+        uart_enqueue(&uart_dev[devno].send_que, &que);
+    }
+    uart_send_drain(devno);
+
     enable_interrupt();
-}
+    /* CRITICAL SECTION: END */
 
-int uart_read(uint32_t devno, char *buf, size_t size)
-{
-    return uart_tread(devno, buf, size, 0);
+    if (n == size)
+        return size;
+
+    /* A caller which cannot wait, e.g. holding a resource, sends the rest by polling. */
+    if ((ret = uart_wait(&que, over)) == UART_WAIT_REFUSED)
+        uart_send_poll(devno, &que);
+    else if (ret < 0)
+        return ret;
+
+    return size - que.size;
 }
 
-int uart_tread(uint32_t devno, char *buf, size_t size, tick_t over)
+static int uart_recv(uint32_t devno, char *buf, size_t size, tick_t over, bool_t line)
 {
+    /*
+     * The bytes already received in the ring are taken at once,
+     * and the reader waits only for the rest.
+     */
+    uart_dev_t *dp;
     uart_que_t que;
-    event_mask_type_t event;
+    int ret;
 
-    if (over > 0)
-        que.timeout = TRUE;
-    else
-        que.timeout = FALSE;
-    que.over = over;
-    uart_recv_request(devno, buf, size, &que);
+    if (devno >= NR_UART_DEV || !uart_dev[devno].opened)
+        return -2;
 
-    if (over > 0)
-        wait_event(EV_UART_COMPLETE | EV_UART_TIMEOUT);
-    else
-        wait_event(EV_UART_COMPLETE);
+    dp = &uart_dev[devno];
 
-    get_event(task_id(), &event);
-    clear_event(event);
+    que.devno   = devno;
+    que.buf     = buf;
+    que.size    = size;
+    que.timeout = (over > 0) ? TRUE : FALSE;
+    que.line    = line;
+    que.over    = over;
+    que.task_id = task_id();
 
-    if (over > 0) {
-        if ((event & EV_UART_TIMEOUT))
-            return -1;
-    }
-    else if (!(event & EV_UART_COMPLETE))
+    /* CRITICAL SECTION: BEGIN */
+    disable_interrupt();
+
+    if (uart_oldest(&dp->recv_que) == NULL)
+        uart_recv_take(dp, &que);
+    if (que.size)
+        uart_enqueue(&dp->recv_que, &que);
+
+    enable_interrupt();
+    /* CRITICAL SECTION: END */
+
+    if (que.size == 0)
+        return que.buf - buf;
+
+    if ((ret = uart_wait(&que, over)) == UART_WAIT_REFUSED)
         return -2;
+    else if (ret < 0)
+        return ret;
 
-    return size - que.size;
+    return que.buf - buf;
+}
+
+int uart_read(uint32_t devno, char *buf, size_t size)
+{
+    return uart_recv(devno, buf, size, 0, FALSE);
+}
+
+int uart_tread(uint32_t devno, char *buf, size_t size, tick_t over)
+{
+    return uart_recv(devno, buf, size, over, FALSE);
+}
+
+int uart_read_line(uint32_t devno, char *buf, size_t size)
+{
+    /* Read up to a newline, which is included in the bytes read. */
+    return uart_recv(devno, buf, size, 0, TRUE);
 }
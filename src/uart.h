@@ -11,13 +11,19 @@ typedef struct uart_que {
     char *buf;
     size_t size;
     bool_t timeout;
+    bool_t line;      /* Completed also by the end of a line */
     tick_t over;
     task_type_t task_id;
 } uart_que_t;
 
+/* Flags of uart_info_t */
+#define UART_FLAG_CANON 0x1 /* Assemble lines, erasing a character by backspace */
+#define UART_FLAG_ECHO  0x2 /* Echo the received characters */
+
 typedef struct {
     uint32_t devno;
     uint32_t baud_rate;
+    uint32_t flags;
 } uart_info_t;
 
 int uart_open(uart_info_t *dev);
@@ -26,5 +32,6 @@ int uart_write(uint32_t devno, char *buf, size_t size);
 int uart_twrite(uint32_t devno, char *buf, size_t size, tick_t over);
 int uart_read(uint32_t devno, char *buf, size_t size);
 int uart_tread(uint32_t devno, char *buf, size_t size, tick_t over);
+int uart_read_line(uint32_t devno, char *buf, size_t size);
 
 #endif
@@ -4,7 +4,6 @@
 #include "stdtype.h"
 
 #define PRI_MAX    255
-#define USER_TASK_STACK_SIZE    2048
 #define DEFAULT_TASK_STACK_SIZE 64
 
 typedef unsigned int task_type_t;
@@ -33,6 +32,7 @@ typedef enum {
     E_OS_RESOURCE = 6,
     E_OS_STATE    = 7,
     E_OS_VALUE    = 8,
+    E_OS_TIMEOUT  = 9,
 } status_type_t;
 
 typedef status_type_t (*sys_call_t)(void);
@@ -62,20 +62,40 @@ typedef enum {
     ALARM_STATE_ACTIVE,
 } alarm_state_t;
 
+typedef enum {
+    RES_TYPE_CEILING,  /* Priority ceiling protocol */
+    RES_TYPE_MUTEX,    /* Priority inheritance protocol */
+} res_type_t;
+
+typedef enum {
+    COUNTER_TYPE_HARDWARE,
+    COUNTER_TYPE_SOFTWARE,
+} counter_type_t;
+
 typedef struct {
     tick_t maxallowedvalue;
     tick_t ticksperbase;
     tick_t mincycle;
 } alarm_base_t;
 
+typedef struct counter_rom {
+    counter_type_t type;
+    alarm_base_t   alarm_base;
+} counter_rom_t;
+
 typedef struct task_rom {
     void     *entry;
     int      pri;
     uint32_t *stack_bottom;
     bool_t   autostart;
+    tick_t   time_slice; /* Ticks given to each turn of round robin, or 0 if not time sliced */
+    uint32_t max_activations; /* Activations which can be recorded at the same time */
+    bool_t   basic;      /* Basic task which never waits and runs on the shared stack */
+    int      dispatch_pri; /* Priority while the task runs (preemption threshold) */
 } task_rom_t;
 
 typedef struct res_rom {
+    res_type_t type;
     int pri;
 } res_rom_t;
 
@@ -91,6 +111,11 @@ typedef struct {
     } action;
 } alarm_action_rom_t;
 
+typedef struct alarm_rom {
+    uint32_t           counter_id;
+    alarm_action_rom_t action;
+} alarm_rom_t;
+
 status_type_t debug(const char *s);
 status_type_t activate_task(task_type_t task_id);
 status_type_t terminate_task(void);
@@ -103,13 +128,26 @@ status_type_t set_event(task_type_t task_id, event_mask_type_t event);
 status_type_t clear_event(event_mask_type_t event);
 status_type_t get_event(task_type_t task_id, event_mask_type_t *event);
 status_type_t wait_event(event_mask_type_t event);
+status_type_t wait_event_all(event_mask_type_t event);
+status_type_t wait_event_timeout(event_mask_type_t event, tick_t ticks);
+status_type_t sleep_ticks(tick_t ticks);
+status_type_t wait_next_period(tick_t *anchor, tick_t period);
+status_type_t get_systick(tick_t *tick);
+status_type_t schedule_task(void);
 status_type_t get_alarm_base(uint32_t alarm_id, alarm_base_t *alarm_base);
 status_type_t get_alarm(uint32_t alarm_id, tick_t *tick);
 status_type_t set_rel_alarm(uint32_t alarm_id, tick_t increment, tick_t cycle);
 status_type_t set_abs_alarm(uint32_t alarm_id, tick_t start, tick_t cycle);
 status_type_t cancel_alarm(uint32_t alarm_id);
+status_type_t increment_counter(uint32_t counter_id);
+
+/* Statistics of the scheduler */
+extern uint32_t dispatch_count;
+extern uint32_t dispatch_elided;
 
 void start_os(void);
+void enter_isr(void);
+void exit_isr(void);
 
 void uros_main(void);
 